@@ -17,202 +17,3619 @@
 
 // NOTE: We don't need to and will not free any memory. This is intentional.
 
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE                     // fopencookie() for tracing stdout
+
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <glob.h>
-#include <poll.h>
-#include <sys/ioctl.h>
-#include <termios.h>
-#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <curses.h>
+#include <term.h>
+
+// tiparm is ncurses-specific, let's make this a tiny bit more portable.
+#define TIPARM(s, v1) tparm((s), (long) (v1))
+
+#define CSI "\x1b["
+#define OSC "\x1b]"
+#define DCS "\x1bP"
+#define ST  "\x1b\\"
+#define ST8 "\x9c"
+#define BEL "\x07"
+
+#define SGR0 CSI "m"
+
+extern char **environ;
+static struct termios saved_termios;
+struct winsize ws;
+
+// In batch mode, nothing may wait for the user, so that runs can't hang.
+static bool interactive = true;
+
+// tty_atexit restores the terminal into its original mode. Some of the tested
+// extensions can't be reset by terminfo strings, so don't bother with that.
+static void tty_atexit() { tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios); }
+
+// tty_cbreak puts the terminal in the cbreak mode.
+static bool tty_cbreak() {
+	if (tcgetattr(STDIN_FILENO, &saved_termios) < 0)
+		return false;
+
+	struct termios buf = saved_termios;
+	buf.c_lflag &= ~(ECHO | ICANON);
+	buf.c_cc[VMIN] = 1;
+	buf.c_cc[VTIME] = 0;
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &buf) < 0)
+		return false;
+
+	if (tcgetattr(STDIN_FILENO, &buf) < 0 || (buf.c_lflag & (ECHO | ICANON)) ||
+		buf.c_cc[VMIN] != 1 || buf.c_cc[VTIME] != 0) {
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+		return false;
+	}
+	return true;
+}
+
+// A scanner splits terminal input into whole tokens: control sequences,
+// control strings, characters, X10 mouse reports, and bracketed pastes.
+struct scanner {
+	enum {
+		SC_GROUND,                      // Between tokens
+		SC_ESC,                         // After ESC
+		SC_CSI,                         // Within a control sequence
+		SC_STRING,                      // Within DCS, OSC, APC, PM, or SOS
+		SC_STRING_ESC,                  // After ESC within a control string
+		SC_CHAR,                        // Within a UTF-8 character
+		SC_MOUSE,                       // Within X10/1005 mouse coordinates
+		SC_PASTE,                       // Within a bracketed paste
+	} state;
+	int chars;                          // Mouse characters to go
+	int continuation;                   // UTF-8 continuation bytes to go
+	char csi[8];                        // Start of CSI parameters
+	size_t csi_len;                     // Length of CSI parameters
+	size_t paste_match;                 // Matched part of the paste end
+};
+
+// utf8_continuation returns the number of bytes that follow a lead byte.
+static int utf8_continuation(unsigned char c) {
+	if (c >= 0xc0 && c < 0xe0)
+		return 1;
+	if (c >= 0xe0 && c < 0xf0)
+		return 2;
+	if (c >= 0xf0 && c < 0xf8)
+		return 3;
+	return 0;
+}
+
+// scanner_feed advances the scanner by one byte of input,
+// and returns whether it has completed a token.
+static bool scanner_feed(struct scanner *sc, unsigned char c) {
+	static const char paste_end[] = CSI "201~";
+	switch (sc->state) {
+	case SC_GROUND:
+		if (c == 0x1b) {
+			sc->state = SC_ESC;
+			return false;
+		}
+		if (!(sc->continuation = utf8_continuation(c)))
+			return true;
+		sc->state = SC_CHAR;
+		return false;
+	case SC_CHAR:
+		if (--sc->continuation > 0)
+			return false;
+		sc->state = SC_GROUND;
+		return true;
+	case SC_ESC:
+		if (c >= 0x20 && c <= 0x2f) {
+			// Intermediates, as in character set designations.
+		} else if (c == '[') {
+			sc->state = SC_CSI;
+			sc->csi_len = 0;
+		} else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X') {
+			sc->state = SC_STRING;
+		} else if (c != 'O') {
+			// SS3 takes one more character, anything else is Alt+key.
+			sc->state = SC_GROUND;
+			return true;
+		} else {
+			sc->state = SC_CHAR;
+			sc->continuation = 1;
+		}
+		return false;
+	case SC_CSI:
+		if (c < 0x40 || c > 0x7e) {
+			if (sc->csi_len < sizeof sc->csi)
+				sc->csi[sc->csi_len] = c;
+			sc->csi_len++;
+			return false;
+		}
+		if (c == 'M' && !sc->csi_len) {
+			// X10 mouse reports carry three raw, maybe UTF-8, characters.
+			sc->state = SC_MOUSE;
+			sc->chars = 3;
+			sc->continuation = 0;
+			return false;
+		}
+		if (c == '~' && sc->csi_len == 3 && !strncmp(sc->csi, "200", 3)) {
+			sc->state = SC_PASTE;
+			sc->paste_match = 0;
+			return false;
+		}
+		sc->state = SC_GROUND;
+		return true;
+	case SC_STRING:
+		if (c == 0x1b)
+			sc->state = SC_STRING_ESC;
+		else if (c == '\a' || c == (unsigned char) *ST8)
+			sc->state = SC_GROUND;
+		return sc->state == SC_GROUND;
+	case SC_STRING_ESC:
+		sc->state = c == '\\' ? SC_GROUND : SC_STRING;
+		return sc->state == SC_GROUND;
+	case SC_MOUSE:
+		if (sc->continuation) {
+			sc->continuation--;
+		} else {
+			sc->continuation = utf8_continuation(c);
+			sc->chars--;
+		}
+		if (sc->continuation || sc->chars)
+			return false;
+		sc->state = SC_GROUND;
+		return true;
+	case SC_PASTE:
+		if (c == (unsigned char) paste_end[sc->paste_match])
+			sc->paste_match++;
+		else
+			sc->paste_match = c == 0x1b;
+		if (paste_end[sc->paste_match])
+			return false;
+		sc->state = SC_GROUND;
+		return true;
+	}
+	return false;
+}
+
+// clock_msec returns the monotonic time in milliseconds.
+static double clock_msec() {
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Smoothed round-trip time and its variation, in milliseconds, as in TCP.
+static struct {
+	double srtt, rttvar;
+	bool valid;
+} rtt;
+
+// rtt_sample updates the round-trip time estimate, see RFC 6298.
+static void rtt_sample(double r) {
+	if (!rtt.valid) {
+		rtt.srtt = r;
+		rtt.rttvar = r / 2;
+		rtt.valid = true;
+		return;
+	}
+
+	double delta = rtt.srtt > r ? rtt.srtt - r : r - rtt.srtt;
+	rtt.rttvar = 0.75 * rtt.rttvar + 0.25 * delta;
+	rtt.srtt = 0.875 * rtt.srtt + 0.125 * r;
+}
+
+// response_timeout returns how long to wait for further input, in milliseconds.
+// Terminals may need a bit of time to process whatever we've sent them,
+// so don't go all the way down to what the link itself would allow.
+// Fenced exchanges end as soon as they're complete, so this costs little.
+static int response_timeout() {
+	if (!rtt.valid)
+		return 250;
+
+	double rto = rtt.srtt + 4 * rtt.rttvar;
+	return rto < 50 ? 50 : rto > 3000 ? 3000 : rto;
+}
+
+// A buffer is a growable array of bytes, always terminated by a NUL.
+struct buffer {
+	char *s;
+	size_t len, alloc;
+};
+
+// buffer_reserve makes room for at least n more bytes in the buffer,
+// and returns a pointer to where they are to be written.
+static char *buffer_reserve(struct buffer *b, size_t n) {
+	if (b->alloc < b->len + n + 1) {
+		while (b->alloc < b->len + n + 1)
+			b->alloc = b->alloc ? b->alloc * 2 : 4096;
+		if (!(b->s = realloc(b->s, b->alloc)))
+			abort();
+		b->s[b->len] = 0;
+	}
+	return b->s + b->len;
+}
+
+// buffer_append appends bytes to the buffer.
+static void buffer_append(struct buffer *b, const void *data, size_t n) {
+	if (!n)
+		return;
+	memcpy(buffer_reserve(b, n), data, n);
+	b->s[b->len += n] = 0;
+}
+
+// A trace records all terminal I/O, in memory, so as not to disturb timing.
+// It starts with a magic number, and the wall clock time in nanoseconds,
+// followed by records: time since the previous one in nanoseconds,
+// a direction byte, data length, and the data. Numbers are LEB128 varints.
+static struct {
+	int fd;                             // Where to save the trace, or -1
+	struct buffer data;                 // Records that haven't been saved
+	uint64_t last;                      // Monotonic time of the last record
+} io_trace = { .fd = -1 };
+
+#define TRACE_MAGIC "TTR1"
+enum { TRACE_OUTPUT = 'O', TRACE_INPUT = 'I' };
+
+// Saving such large amounts takes long enough to need to be rare.
+enum { TRACE_FLUSH_THRESHOLD = 256 << 20 };
+
+// clock_nsec returns monotonic time in nanoseconds.
+static uint64_t clock_nsec() {
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+// trace_varint appends an unsigned LEB128 number to the trace.
+static void trace_varint(uint64_t n) {
+	char *p = buffer_reserve(&io_trace.data, 10), *start = p;
+	do {
+		*p++ = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+		n >>= 7;
+	} while (n);
+	io_trace.data.s[io_trace.data.len += p - start] = 0;
+}
+
+// trace_flush saves all records, including anything still waiting in stdio.
+static void trace_flush() {
+	if (io_trace.fd < 0)
+		return;
+
+	fflush(stdout);
+	for (size_t i = 0; i < io_trace.data.len; ) {
+		ssize_t n =
+			write(io_trace.fd, io_trace.data.s + i, io_trace.data.len - i);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		i += n;
+	}
+	io_trace.data.len = 0;
+}
+
+// trace_record appends a record of terminal I/O to the trace, if enabled.
+static void trace_record(int direction, const void *data, size_t len) {
+	if (io_trace.fd < 0 || !len)
+		return;
+
+	uint64_t now = clock_nsec();
+	trace_varint(now - io_trace.last);
+	io_trace.last = now;
+	buffer_append(&io_trace.data, &(char) { direction }, 1);
+	trace_varint(len);
+	buffer_append(&io_trace.data, data, len);
+	if (io_trace.data.len > TRACE_FLUSH_THRESHOLD)
+		trace_flush();
+}
+
+// trace_stdout_write passes stdio output on to the terminal, recording it.
+static ssize_t trace_stdout_write(void *cookie, const char *buf, size_t len) {
+	(void) cookie;
+	ssize_t n = write(STDOUT_FILENO, buf, len);
+	if (n > 0)
+		trace_record(TRACE_OUTPUT, buf, n);
+	return n;
+}
+
+// trace_open starts recording a trace into a file. Output that goes through
+// stdio can only be intercepted with glibc, which lets us replace stdout.
+static bool trace_open(const char *path) {
+	if ((io_trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		return false;
+
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_REALTIME, &ts);
+	buffer_append(&io_trace.data, TRACE_MAGIC, sizeof TRACE_MAGIC - 1);
+	trace_varint(ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec);
+	io_trace.last = clock_nsec();
+
+#ifdef __GLIBC__
+	FILE *fp = fopencookie(NULL, "w",
+		(cookie_io_functions_t) { .write = trace_stdout_write });
+	if (fp) {
+		fflush(stdout);
+		setvbuf(fp, NULL, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, BUFSIZ);
+		stdout = fp;
+	}
+#endif
+	atexit(trace_flush);
+	return true;
+}
+
+// A cache file that is being written, and must not outlive an unfinished run.
+static char *cache_partial;
+
+// When the time budget runs out, as per clock_msec(), or zero if never.
+static double deadline;
+
+// budget_exceeded tries to leave the terminal in a usable state, and exits.
+// Only async-signal-safe functions may be used here.
+static void budget_exceeded(int signum) {
+	(void) signum;
+	static const char reset[] = CSI "?1000l" CSI "?1002l" CSI "?1003l"
+		CSI "?1004l" CSI "?1005l" CSI "?1006l" CSI "?1015l" CSI "?1016l"
+		CSI "?2004l" CSI "?2026l" CSI "?1049l" SGR0
+		"\n-- Time budget exceeded\n";
+	(void) write(STDOUT_FILENO, reset, sizeof reset - 1);
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+	if (cache_partial)
+		unlink(cache_partial);
+	if (io_trace.fd >= 0)
+		(void) write(io_trace.fd, io_trace.data.s, io_trace.data.len);
+	_exit(EXIT_FAILURE);
+}
+
+// tty_write writes all of the data to the terminal, returning false on error.
+// Anything still waiting in stdio buffers goes out first.
+static bool tty_write(const void *data, size_t len) {
+	fflush(stdout);
+
+	const char *p = data;
+	while (len) {
+		ssize_t n = write(STDOUT_FILENO, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+
+		trace_record(TRACE_OUTPUT, p, n);
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+// tty_puts writes a string to the terminal, returning false on error.
+static bool tty_puts(const char *s) { return tty_write(s, strlen(s)); }
+
+// tty_read appends available input to the buffer, waiting for at most
+// timeout milliseconds for any to arrive. Returns the number of bytes read,
+// which is zero on timeout, or -1 on error, including end of file.
+static ssize_t tty_read(struct buffer *buf, int timeout) {
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	int n = poll(&pfd, 1, timeout);
+	if (n <= 0)
+		return n < 0 && errno != EINTR ? -1 : 0;
+
+	// Large responses will quickly make the buffer grow big enough.
+	char *p = buffer_reserve(buf, 4096);
+	ssize_t len = read(STDIN_FILENO, p, buf->alloc - buf->len - 1);
+	if (len <= 0)
+		return -1;
+
+	trace_record(TRACE_INPUT, p, len);
+	buf->s[buf->len += len] = 0;
+	return len;
+}
+
+// The last exchange made by comm_buffer(), for structured results.
+static struct {
+	double rtt;                         // Milliseconds, negative if unknown
+	size_t sent;                        // Bytes written to the terminal
+	size_t received;                    // Bytes read from the terminal
+} last;
+
+// comm_buffer writes a string to the terminal and appends the result
+// to a buffer, see comm(). Returns false when an error has happened.
+static bool comm_buffer(struct buffer *resp, const char *req, bool wait_first) {
+	last.rtt = -1;
+	last.sent = strlen(req);
+	last.received = 0;
+	if (!tty_puts(req))
+		return false;
+
+	double sent = clock_msec();
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	if (wait_first && interactive)
+		poll(&pfd, 1, -1);
+
+	// Silent terminals can still only be detected by timing out.
+	int lag = response_timeout();
+	struct scanner sc = { .state = SC_GROUND };
+	bool complete = false;
+	ssize_t len = 0;
+	while (!complete &&
+		(len = tty_read(resp, lag /* unreliable, timing-dependent */))) {
+		if (len < 0)
+			return false;
+
+		last.received += len;
+		for (size_t i = resp->len - len; i < resp->len; i++)
+			complete = scanner_feed(&sc, resp->s[i]);
+	}
+
+	// Human reaction times are of no interest here.
+	if (complete && !wait_first)
+		rtt_sample((last.rtt = clock_msec() - sent));
+	return true;
+}
+
+// comm writes a string to the terminal and waits for a result, which is
+// considered complete as soon as it ends with a whole token. Returns NULL
+// if it didn't manage to get a response, or when an error has happened.
+static char *comm(const char *req, bool wait_first) {
+	struct buffer resp = {0};
+	buffer_reserve(&resp, 0);
+	return comm_buffer(&resp, req, wait_first) ? resp.s : NULL;
+}
+
+// A batch sends any number of queries to the terminal in a single write,
+// fenced by DA1, which all terminals respond to, and in order. A CPR follows
+// as a sentinel, since other responses or stale input may look like DA1.
+struct batch {
+	struct query {
+		const char *req;                // Sequences to send to the terminal
+		const char *expect;             // Response prefix, NULL if none
+		const char *selector;           // DECRQSS setting, NULL if none
+		char *resp;                     // The response, NULL if ignored
+		double rtt;                     // Milliseconds until the response
+	} *queries;
+	size_t len;
+	char *da1;                          // Response to the fence
+	double sent;                        // When the batch has been sent
+	double rtt;                         // Milliseconds until the fence
+	bool complete;                      // The sentinel has arrived
+};
+
+// batch_add appends a query to the batch, and returns its index.
+static size_t batch_add(struct batch *b, const char *expect, const char *req) {
+	b->queries = realloc(b->queries, sizeof *b->queries * (b->len + 1));
+	b->queries[b->len] = (struct query) { .req = req, .expect = expect };
+	return b->len++;
+}
+
+// batch_find returns a query sent within the batch, or NULL if there's none.
+static struct query *batch_find(struct batch *b, const char *req) {
+	for (size_t i = 0; i < b->len; i++)
+		if (!strcmp(b->queries[i].req, req))
+			return &b->queries[i];
+	return NULL;
+}
+
+// decrpss_selects returns whether a response token may be a DECRPSS
+// for the given setting. Invalid requests don't repeat the setting.
+static bool decrpss_selects(const char *token, size_t len, const char *sel) {
+	if (len >= 5 && !strncmp(token, DCS "0$r", 5))
+		return true;
+	if (len < 5 || strncmp(token, DCS "1$r", 5))
+		return false;
+
+	if (len >= 2 && !strncmp(token + len - 2, ST, 2))
+		len -= 2;
+	else if (len && (token[len - 1] == *BEL || token[len - 1] == *ST8))
+		len--;
+
+	size_t sel_len = strlen(sel);
+	return len >= 5 + sel_len && !strncmp(token + len - sel_len, sel, sel_len);
+}
+
+// batch_assign matches a response token to the next query expecting it.
+// Queries that are skipped over have been ignored by the terminal.
+static void batch_assign(
+	struct batch *b, size_t *next, const char *token, size_t len) {
+	char *copy = malloc(len + 1);
+	memcpy(copy, token, len);
+	copy[len] = 0;
+
+	double rtt = clock_msec() - b->sent;
+	if (b->da1 && len > 3 && !strncmp(copy, CSI, 2) && copy[len - 1] == 'R' &&
+		strspn(copy + 2, "0123456789;") == len - 3) {
+		b->complete = true;
+		return;
+	}
+	if (!strncmp(copy, CSI "?", 3) && copy[len - 1] == 'c') {
+		b->da1 = copy;
+		b->rtt = rtt;
+		return;
+	}
+	for (size_t i = *next; i < b->len; i++) {
+		const char *expect = b->queries[i].expect;
+		const char *selector = b->queries[i].selector;
+		if (expect && !strncmp(copy, expect, strlen(expect)) &&
+			(!selector || decrpss_selects(copy, len, selector))) {
+			b->queries[i].resp = copy;
+			b->queries[i].rtt = rtt;
+			*next = i + 1;
+			return;
+		}
+	}
+	// Unsolicited input, such as key presses, gets dropped.
+}
+
+// batch_run sends all queries at once, and splits the responses, giving up
+// when the terminal stays silent for timeout milliseconds. Returns false
+// if the terminal hasn't responded to the fence, or an error has happened.
+// A terminal that has merely paused gets another second to catch up,
+// so that the rest of its responses don't get mistaken for later ones.
+static bool batch_run(struct batch *b, int timeout) {
+	size_t req_len = sizeof CSI "c" CSI "6n";
+	for (size_t i = 0; i < b->len; i++)
+		req_len += strlen(b->queries[i].req);
+
+	char *req = calloc(1, req_len), *p = req;
+	for (size_t i = 0; i < b->len; i++)
+		p = stpcpy(p, b->queries[i].req);
+	strcpy(p, CSI "c" CSI "6n");
+	b->sent = clock_msec();
+	if (!tty_write(req, req_len - 1))
+		return false;
+
+	struct scanner sc = { .state = SC_GROUND };
+	struct buffer buf = {0};
+	size_t next = 0;
+	ssize_t len = 0;
+	while (!b->complete && (len = tty_read(&buf, timeout)) >= 0) {
+		if (!len && timeout >= 1000)
+			break;
+		if (!len) {
+			timeout = 1000;
+			continue;
+		}
+
+		// Only keep around the unfinished token, if any.
+		size_t token = 0;
+		for (size_t i = buf.len - len; i < buf.len; i++) {
+			if (scanner_feed(&sc, buf.s[i])) {
+				batch_assign(b, &next, buf.s + token, i + 1 - token);
+				token = i + 1;
+			}
+		}
+		memmove(buf.s, buf.s + token, buf.len - token + 1);
+		buf.len -= token;
+	}
+	return b->complete;
+}
+
+// rtt_calibrate times a few round trips that all terminals should respond to.
+static void rtt_calibrate() {
+	for (int i = 0; i < 8; i++)
+		comm(i % 2 ? CSI "6n" : CSI "c", false);
+}
+
+enum { DEC_UNKNOWN, DEC_SET, DEC_RESET, DEC_PERMSET, DEC_PERMRESET };
+
+// decrpmstr returns a textual description of a DECRPM response.
+static const char *decrpmstr(int status) {
+	switch (status) {
+	case DEC_UNKNOWN:
+		return "unknown";
+	case DEC_SET:
+		return "set";
+	case DEC_RESET:
+		return "reset";
+	case DEC_PERMSET:
+		return "permanently set";
+	case DEC_PERMRESET:
+		return "permanently reset";
+	default:
+		return "?";
+	}
+}
+
+// parse_decrpm returns whether the mode response is valid (result >= 0),
+// as well as the terminal's response if it is, see the DEC_* constants.
+// Both DEC private and ANSI mode responses are accepted.
+static int parse_decrpm(const char *resp) {
+	// E.g., \x1b[?1000;2$y, or \x1b[4;2$y
+	if (!resp || resp[0] != '\x1b' || resp[1] != '[')
+		return -1;
+
+	char *end = NULL;
+	errno = 0;
+	long mode = strtol(resp + 2 + (resp[2] == '?'), &end, 10);
+	if (errno || mode < 0 || *end != ';')
+		return -1;
+	if (!isdigit(end[1]) || end[2] != '$' || end[3] != 'y' || end[4])
+		return -1;
+	return end[1] - '0';
+}
+
+// batch_decrqm adds a DECRQM query for a particular mode to the batch,
+// either a DEC private mode, or an ANSI one.
+static size_t batch_decrqm(struct batch *b, bool dec, int number) {
+	char *req = malloc(32), *expect = malloc(32);
+	snprintf(req, 32, CSI "%s%d$p", dec ? "?" : "", number);
+	snprintf(expect, 32, CSI "%s%d;", dec ? "?" : "", number);
+	return batch_add(b, expect, req);
+}
+
+// batch_decrqss adds a DECRQSS query for a setting to the batch, preceded
+// by sequences that change it. Its response must select the same setting.
+static size_t batch_decrqss(struct batch *b, const char *pre, const char *sel) {
+	char *req = malloc(strlen(pre) + strlen(sel) + 16);
+	sprintf(req, "%s" DCS "$q%s" ST "\r", pre, sel);
+	size_t i = batch_add(b, DCS, req);
+	b->queries[i].selector = sel;
+	return i;
+}
+
+// deccheck checks whether a particular DEC mode is supported, whether it is
+// enabled, and returns that information as a string. The response is taken
+// from the batch if it has already asked about the mode.
+static const char *deccheck(struct batch *b, int number) {
+	char buf[1000] = "";
+	snprintf(buf, sizeof buf, CSI "?%d$p", number);
+	struct query *q = b ? batch_find(b, buf) : NULL;
+	return decrpmstr(parse_decrpm(q ? q->resp : comm(buf, false)));
+}
+
+// Structured results get written here, one JSON object per line,
+// and possibly also to a cache file that is being refreshed.
+static FILE *results, *cache;
+
+// json_string writes out a JSON string, or null. Replies needn't be valid
+// UTF-8, so all non-ASCII bytes are escaped, as if they were Latin-1.
+static void json_string(FILE *fp, const char *s) {
+	if (!s) {
+		fputs("null", fp);
+		return;
+	}
+
+	fputc('"', fp);
+	for (const unsigned char *p = (const unsigned char *) s; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(fp, "\\%c", *p);
+		else if (*p < 32 || *p >= 127)
+			fprintf(fp, "\\u%04x", *p);
+		else
+			fputc(*p, fp);
+	}
+	fputc('"', fp);
+}
+
+// result_write writes out a single probe result as a line of JSON.
+static void result_write(FILE *fp, const char *feature, const char *raw,
+	const char *value, double rtt, size_t sent, size_t received) {
+	fputs("{\"feature\":", fp);
+	json_string(fp, feature);
+	fputs(",\"raw\":", fp);
+	json_string(fp, raw);
+	fputs(",\"value\":", fp);
+	json_string(fp, value);
+	if (rtt < 0)
+		fputs(",\"rtt_ms\":null", fp);
+	else
+		fprintf(fp, ",\"rtt_ms\":%.3f", rtt);
+	fprintf(fp, ",\"sent\":%zu,\"received\":%zu}\n", sent, received);
+	fflush(fp);
+}
+
+// result reports the outcome of a single probe, if requested, right away.
+// A negative round-trip time means that it is unknown.
+static void result(const char *feature, const char *raw, const char *value,
+	double rtt, size_t sent, size_t received) {
+	if (results)
+		result_write(results, feature, raw, value, rtt, sent, received);
+	if (cache)
+		result_write(cache, feature, raw, value, rtt, sent, received);
+}
+
+// result_query reports the outcome of a batched query.
+static void result_query(
+	const char *feature, const struct query *q, const char *value) {
+	result(feature, q->resp, value, q->resp ? q->rtt : -1,
+		strlen(q->req), q->resp ? strlen(q->resp) : 0);
+}
+
+// result_comm reports the outcome of the last comm() call.
+static void result_comm(
+	const char *feature, const char *raw, const char *value) {
+	result(feature, raw, value, last.rtt, last.sent, last.received);
+}
+
+// result_decrqm reports the outcome of a batched DECRQM query.
+static void result_decrqm(const struct query *q) {
+	// The request already contains the mode number in its canonical form.
+	char feature[32] = "";
+	snprintf(feature, sizeof feature, "DECRQM %.*s",
+		(int) strlen(q->req) - 4, q->req + 2);
+	result_query(feature, q, q->resp ? decrpmstr(parse_decrpm(q->resp)) : NULL);
+}
+
+#define FNV_OFFSET UINT64_C(0xcbf29ce484222325)
+#define FNV_PRIME  UINT64_C(0x100000001b3)
+
+// fnv1a folds a string into an FNV-1a hash, along with its terminating
+// null character, so that a sequence of strings is hashed unambiguously.
+static uint64_t fnv1a(uint64_t hash, const char *s) {
+	if (!s)
+		return (hash ^ 0xff) * FNV_PRIME;
+
+	do {
+		hash ^= (unsigned char) *s;
+		hash *= FNV_PRIME;
+	} while (*s++);
+	return hash;
+}
+
+// identity_key hashes TERM, version environment variables, responses
+// to an identification batch, and whether the run is interactive, which
+// decides what gets tested. Only variable names are matched, as their
+// values might differ between sessions of the same terminal.
+static uint64_t identity_key(const char *term, const struct batch *b) {
+	// The order of environment variables isn't significant.
+	uint64_t key = fnv1a(FNV_OFFSET, term), env = 0;
+	for (char **p = environ; *p; p++) {
+		const char *name_end = strchr(*p, '=');
+		const char *version = strstr(*p, "VERSION");
+		if (version && (!name_end || version < name_end))
+			env += fnv1a(FNV_OFFSET, *p);
+	}
+
+	key = fnv1a(key, interactive ? "interactive" : "batch");
+	key = fnv1a(key, b->da1);
+	for (size_t i = 0; i < b->len; i++)
+		key = fnv1a(key, b->queries[i].resp);
+	return key ^ env;
+}
+
+// cache_replay copies stored results over to where fresh ones would go.
+// Returns false if there are none.
+static bool cache_replay(const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return false;
+
+	char buf[BUFSIZ];
+	FILE *out = results ? results : stdout;
+	for (size_t len; (len = fread(buf, 1, sizeof buf, fp)); )
+		fwrite(buf, 1, len, out);
+	fclose(fp);
+	fflush(out);
+	return true;
+}
+
+// known_modes lists modes worth sweeping through, mostly following the names
+// used by ECMA-48, DEC manuals, and xterm's ctlseqs documentation.
+static const struct known_mode {
+	bool dec;                           // DEC private mode
+	int number;                         // Mode number
+	const char *name;                   // Mnemonic or short description
+} known_modes[] = {
+	{ false, 1, "GATM" }, { false, 2, "KAM" }, { false, 3, "CRM" },
+	{ false, 4, "IRM" }, { false, 5, "SRTM" }, { false, 6, "ERM" },
+	{ false, 7, "VEM" }, { false, 10, "HEM" }, { false, 11, "PUM" },
+	{ false, 12, "SRM" }, { false, 13, "FEAM" }, { false, 14, "FETM" },
+	{ false, 15, "MATM" }, { false, 16, "TTM" }, { false, 17, "SATM" },
+	{ false, 18, "TSM" }, { false, 19, "EBM" }, { false, 20, "LNM" },
+
+	{ true, 1, "DECCKM" }, { true, 2, "DECANM" }, { true, 3, "DECCOLM" },
+	{ true, 4, "DECSCLM" }, { true, 5, "DECSCNM" }, { true, 6, "DECOM" },
+	{ true, 7, "DECAWM" }, { true, 8, "DECARM" }, { true, 9, "X10 mouse" },
+	{ true, 10, "Toolbar" }, { true, 12, "Blinking cursor" },
+	{ true, 18, "DECPFF" }, { true, 19, "DECPEX" }, { true, 25, "DECTCEM" },
+	{ true, 30, "Scrollbar" }, { true, 35, "Font shifting" },
+	{ true, 38, "DECTEK" }, { true, 40, "Allow 80/132" },
+	{ true, 41, "more(1) fix" }, { true, 42, "DECNRCM" },
+	{ true, 44, "Margin bell" }, { true, 45, "Reverse wraparound" },
+	{ true, 46, "Logging" }, { true, 47, "Alternate screen" },
+	{ true, 66, "DECNKM" }, { true, 67, "DECBKM" }, { true, 69, "DECLRMM" },
+	{ true, 80, "DECSDM" }, { true, 95, "DECNCSM" },
+	{ true, 1000, "Mouse: normal" }, { true, 1001, "Mouse: highlight" },
+	{ true, 1002, "Mouse: button events" }, { true, 1003, "Mouse: any event" },
+	{ true, 1004, "Focus events" }, { true, 1005, "Mouse: UTF-8" },
+	{ true, 1006, "Mouse: SGR" }, { true, 1007, "Alternate scroll" },
+	{ true, 1010, "Scroll on output" }, { true, 1011, "Scroll on key" },
+	{ true, 1015, "Mouse: urxvt" }, { true, 1016, "Mouse: SGR pixels" },
+	{ true, 1034, "Meta sets 8th bit" }, { true, 1035, "Num Lock modifier" },
+	{ true, 1036, "Meta sends ESC" }, { true, 1037, "Keypad DEL" },
+	{ true, 1039, "Alt sends ESC" }, { true, 1040, "Keep selection" },
+	{ true, 1041, "Use CLIPBOARD" }, { true, 1042, "Urgency on bell" },
+	{ true, 1043, "Raise on bell" }, { true, 1044, "Reuse CLIPBOARD" },
+	{ true, 1046, "Alternate screen switching" },
+	{ true, 1047, "Alternate screen, clearing" },
+	{ true, 1048, "Save cursor" }, { true, 1049, "Alternate screen, saving" },
+	{ true, 2004, "Bracketed paste" }, { true, 2026, "Synchronized output" },
+	{ true, 2027, "Grapheme clusters" }, { true, 2031, "Palette updates" },
+	{ true, 2048, "In-band resize" }, { true, 7727, "Application escape" },
+	{ true, 8452, "Sixel cursor placement" },
+};
+
+// sweep_modes asks about all known modes in a single batch,
+// and prints out what the terminal has told us about them.
+static void sweep_modes() {
+	size_t n = sizeof known_modes / sizeof *known_modes;
+	struct batch b = {0};
+	for (size_t i = 0; i < n; i++)
+		batch_decrqm(&b, known_modes[i].dec, known_modes[i].number);
+
+	double start = clock_msec();
+	bool fenced = batch_run(&b, response_timeout());
+	printf("%zu modes queried in %.3f ms%s\n", n, clock_msec() - start,
+		fenced ? "" : ", DA1 hasn't been responded to");
+
+	for (size_t i = 0; i < n; i++) {
+		const struct known_mode *m = &known_modes[i];
+		const char *resp = b.queries[i].resp;
+		printf("%s%-5d %-27s %s\n", m->dec ? "?" : " ", m->number, m->name,
+			resp ? decrpmstr(parse_decrpm(resp)) : "no response");
+		result_decrqm(&b.queries[i]);
+	}
+}
+
+// fence waits until the terminal has processed everything sent to it so far,
+// as indicated by a response to DA1, followed by the CPR sentinel.
+// Returns false if there's none.
+static bool fence() {
+	// Output might queue up, and a terminal can take its time to process it.
+	// A silent terminal costs the whole timeout, but no further draining.
+	struct batch b = {0};
+	return batch_run(&b, 60000);
+}
+
+// bench_start switches to the alternate screen, so that benchmarks don't wipe
+// out scrollback, and returns the time at which the terminal has settled.
+static double bench_start() {
+	tty_puts(CSI "?1049h" CSI "H" CSI "2J");
+	fence();
+	return clock_msec();
+}
+
+// bench_stop returns the number of milliseconds that the terminal has taken to
+// process all output since bench_start(), or a negative number on failure.
+static double bench_stop(double start) {
+	bool ok = fence();
+	double elapsed = clock_msec() - start;
+	tty_puts(SGR0 CSI "?1049l");
+	return ok ? elapsed : -1;
+}
+
+// bench_report prints out the throughput of a benchmark, and reports it.
+static void bench_report(const char *feature,
+	double ms, size_t bytes, double n, const char *unit) {
+	if (ms < 0) {
+		printf("The terminal has stopped responding.\n");
+		result(feature, NULL, NULL, -1, bytes, 0);
+		return;
+	}
+
+	double mib = bytes / 1048576., seconds = ms / 1000;
+	printf("%.2f MiB in %.1f ms: %.2f MiB/s, %.0f %s/s\n",
+		mib, ms, mib / seconds, n / seconds, unit);
+
+	char value[64] = "";
+	snprintf(value, sizeof value, "%.2f MiB/s", mib / seconds);
+	result(feature, NULL, value, -1, bytes, 0);
+}
+
+// bench_text measures how fast the terminal processes plain ASCII text.
+static void bench_text(size_t size) {
+	ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
+	int width = ws.ws_col > 1 ? ws.ws_col - 1 : 79;
+
+	// Shift the characters on each line, like a classic ripple test would.
+	enum { PAGE_LINES = 94 };
+	struct buffer page = {0};
+	for (int i = 0; i < PAGE_LINES; i++) {
+		char *p = buffer_reserve(&page, width);
+		for (int k = 0; k < width; k++)
+			p[k] = '!' + (i + k) % 94;
+		page.len += width;
+		buffer_append(&page, "\r\n", 2);
+	}
+
+	size_t written = 0, newlines = 0;
+	double start = bench_start();
+	for (; written < size; written += page.len, newlines += PAGE_LINES)
+		if (!tty_write(page.s, page.len))
+			break;
+	bench_report("Text throughput", bench_stop(start), written, newlines,
+		"lines");
+}
+
+// bench_scroll_one runs a single kind of scrolling: after a setup sequence,
+// it repeats a unit that scrolls by one line for the given number of times.
+static void bench_scroll_one(
+	const char *label, const char *setup, const char *unit, size_t scrolls) {
+	enum { CHUNK_UNITS = 256 };
+	struct buffer chunk = {0};
+	for (int i = 0; i < CHUNK_UNITS; i++)
+		buffer_append(&chunk, unit, strlen(unit));
+
+	size_t written = 0, done = 0;
+	double start = bench_start();
+	tty_puts(setup);
+	for (; done < scrolls; done += CHUNK_UNITS, written += chunk.len)
+		if (!tty_write(chunk.s, chunk.len))
+			break;
+
+	// Scrolling regions would otherwise survive the alternate screen.
+	tty_puts(CSI "r");
+	double elapsed = bench_stop(start);
+	char feature[64] = "";
+	snprintf(feature, sizeof feature, "Scrolling, %.*s",
+		(int) strlen(label) - 1, label);
+	printf("%-14s", label);
+	bench_report(feature, elapsed, written, done, "lines");
+}
+
+// bench_scroll measures how fast the terminal scrolls, in several ways.
+static void bench_scroll(size_t size) {
+	ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
+	int rows = ws.ws_row > 3 ? ws.ws_row : 24;
+	size_t scrolls = size / 80;
+
+	char setup[64] = "";
+	snprintf(setup, sizeof setup, CSI "%dH", rows);
+	bench_scroll_one("Full screen:", setup, "Scrolling\r\n", scrolls);
+
+	// Excluding the first and the last line prevents scrolling the whole
+	// screen, which terminals tend to have optimised.
+	snprintf(setup, sizeof setup, CSI "2;%dr" CSI "%dH", rows - 1, rows - 1);
+	bench_scroll_one("Region:", setup, "Scrolling\r\n", scrolls);
+
+	snprintf(setup, sizeof setup, CSI "%dH" "Scrolling", rows / 2);
+	bench_scroll_one("SU:", setup, CSI "S", scrolls);
+	bench_scroll_one("SD:", setup, CSI "T", scrolls);
+}
+
+// churn_cell prints a single character cell with its own attributes, cycling
+// through all kinds of colours, in both separator forms, and some attributes.
+static int churn_cell(char *p, size_t len, unsigned i) {
+	static const char *attrs[] = { "", "1;", "3;", "4;", "53;", "1;3;4;53;" };
+	const char *a = attrs[i / 6 % 6];
+	unsigned c = i * 37, r = c % 256, g = c / 3 % 256, b = c / 7 % 256;
+	char glyph = '!' + i % 94;
+	switch (i % 6) {
+	case 0:
+		return snprintf(p, len, CSI "0;%s3%u;4%um%c", a, c % 8, r % 8, glyph);
+	case 1:
+		return snprintf(p, len, CSI "0;%s9%u;10%um%c", a, c % 8, r % 8, glyph);
+	case 2:
+		return snprintf(p, len, CSI "0;%s38;5;%u;48;5;%um%c", a, r, g, glyph);
+	case 3:
+		return snprintf(p, len, CSI "0;%s38:5:%u;48:5:%um%c", a, r, g, glyph);
+	case 4:
+		return snprintf(p, len, CSI "0;%s38;2;%u;%u;%u;48;2;%u;%u;%um%c",
+			a, r, g, b, b, r, g, glyph);
+	default:
+		return snprintf(p, len, CSI "0;%s38:2::%u:%u:%u;48:2::%u:%u:%um%c",
+			a, r, g, b, b, r, g, glyph);
+	}
+}
+
+// churn_frame appends a full screen of churn_cell() cells to the buffer.
+static void churn_frame(struct buffer *frame, int rows, int cols, int variant) {
+	buffer_append(frame, CSI "H", 3);
+	for (int y = 0; y < rows; y++) {
+		for (int x = 0; x < cols; x++) {
+			char *p = buffer_reserve(frame, 64);
+			frame->len += churn_cell(p, 64, variant + y * cols + x);
+		}
+		if (y + 1 < rows)
+			buffer_append(frame, SGR0 "\r\n", 5);
+	}
+}
+
+// bench_sgr measures how fast the terminal redraws the whole screen
+// when the attributes of every single cell differ from the previous one.
+static void bench_sgr(size_t size) {
+	ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
+	int rows = ws.ws_row ? ws.ws_row : 24, cols = ws.ws_col ? ws.ws_col : 80;
+
+	// Vary the frames a bit, so that the terminal can't skip anything.
+	enum { FRAME_VARIANTS = 7 };
+	struct buffer frames[FRAME_VARIANTS] = {0};
+	for (int f = 0; f < FRAME_VARIANTS; f++)
+		churn_frame(&frames[f], rows, cols, f);
+
+	size_t written = 0, count = 0;
+	double start = bench_start();
+	for (; written < size; count++) {
+		const struct buffer *frame = &frames[count % FRAME_VARIANTS];
+		if (!tty_write(frame->s, frame->len))
+			break;
+		written += frame->len;
+	}
+
+	double elapsed = bench_stop(start);
+	printf("%zu frames of %dx%d cells\n", count, cols, rows);
+	bench_report("Attribute churn",
+		elapsed, written, (double) count * rows * cols, "cells");
+	if (elapsed >= 0)
+		printf("%.1f frames/s\n", count / (elapsed / 1000));
+}
+
+// A series of measurements, in milliseconds.
+struct samples {
+	double *v;
+	size_t len, alloc;
+};
+
+// samples_add appends a measurement to the series.
+static void samples_add(struct samples *s, double v) {
+	if (s->len == s->alloc) {
+		s->alloc = s->alloc ? s->alloc * 2 : 64;
+		if (!(s->v = realloc(s->v, sizeof *s->v * s->alloc)))
+			abort();
+	}
+	s->v[s->len++] = v;
+}
+
+// samples_cmp orders measurements for qsort().
+static int samples_cmp(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+// samples_print sorts the series, prints out a summary of it,
+// and reports its median.
+static void samples_print(const char *feature, struct samples *s) {
+	if (!s->len) {
+		printf("no samples\n");
+		result(feature, NULL, NULL, -1, 0, 0);
+		return;
+	}
+
+	qsort(s->v, s->len, sizeof *s->v, samples_cmp);
+	double sum = 0;
+	for (size_t i = 0; i < s->len; i++)
+		sum += s->v[i];
+	printf("n=%zu, mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f ms\n",
+		s->len, sum / s->len, s->v[(s->len - 1) / 2],
+		s->v[(s->len - 1) * 9 / 10], s->v[(s->len - 1) * 99 / 100],
+		s->v[s->len - 1]);
+
+	double median = s->v[(s->len - 1) / 2];
+	char value[64] = "";
+	snprintf(value, sizeof value, "%.3f ms", median);
+	result(feature, NULL, value, median, 0, 0);
+}
+
+// bench_sync compares how long it takes the terminal to finish full screen
+// redraws with and without synchronized output, frame by frame.
+static void bench_sync(size_t size) {
+	printf("DECRQM: %s\n", deccheck(NULL, 2026));
+
+	ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
+	int rows = ws.ws_row ? ws.ws_row : 24, cols = ws.ws_col ? ws.ws_col : 80;
+	struct buffer frame = {0};
+	churn_frame(&frame, rows, cols, 0);
+
+	// Each frame costs a round trip, so don't go overboard.
+	size_t count = size / frame.len;
+	count = count < 10 ? 10 : count > 200 ? 200 : count;
+
+	static const char *labels[] = { "Unwrapped:", "Synchronized:" };
+	static const char *features[] = {
+		"Frame latency, unwrapped", "Frame latency, synchronized" };
+	for (int sync = 0; sync < 2; sync++) {
+		struct samples latency = {0};
+		bench_start();
+		for (size_t i = 0; i < count; i++) {
+			double start = clock_msec();
+			if ((sync && !tty_puts(CSI "?2026h")) ||
+				!tty_write(frame.s, frame.len) ||
+				(sync && !tty_puts(CSI "?2026l")) || !fence())
+				break;
+			samples_add(&latency, clock_msec() - start);
+		}
+		bench_stop(clock_msec());
+		printf("%-14s", labels[sync]);
+		samples_print(features[sync], &latency);
+	}
+}
+
+// profile_queries times many round trips for each kind of query that we use,
+// one by one, and prints out the distribution of their latencies.
+static void profile_queries(size_t count) {
+	static const struct { const char *name, *req, *expect; } kinds[] = {
+		{ "DA1:", CSI "c", CSI "?" },
+		{ "CPR:", CSI "6n", CSI },
+		{ "DECRQM:", CSI "?1000$p", CSI "?1000;" },
+		{ "DECRQSS:", DCS "$qm" ST, DCS },
+		{ "OSC 4:", OSC "4;1;?" BEL, OSC "4;" },
+	};
+	for (size_t i = 0; i < sizeof kinds / sizeof *kinds; i++) {
+		struct samples latency = {0};
+		struct buffer resp = {0};
+		buffer_reserve(&resp, 0);
+		for (size_t k = 0; k < count; k++) {
+			resp.s[resp.len = 0] = 0;
+			double start = clock_msec();
+			if (!comm_buffer(&resp, kinds[i].req, false) ||
+				strncmp(resp.s, kinds[i].expect, strlen(kinds[i].expect)))
+				break;
+			samples_add(&latency, clock_msec() - start);
+		}
+
+		char feature[64] = "";
+		snprintf(feature, sizeof feature, "Latency, %.*s",
+			(int) strlen(kinds[i].name) - 1, kinds[i].name);
+		printf("%-14s", kinds[i].name);
+		if (latency.len < count)
+			printf("(no response) ");
+		samples_print(feature, &latency);
+	}
+}
+
+// Text samples for the Unicode benchmark, with their widths in cells,
+// presuming that the terminal doesn't join grapheme clusters.
+static const struct corpus {
+	const char *name;                   // Short description
+	const char *sample;                 // UTF-8 encoded sample text
+	int width;                          // Width of the sample in cells
+} corpora[] = {
+	{ "ASCII", "The quick brown fox jumps over the lazy dog. ", 45 },
+	{ "Wide", "漢字かなカナ한글中文日本語 ", 27 },
+	{ "Combining",
+		"a\xcc\x81" "e\xcc\x80" "i\xcc\x82" "o\xcc\x83" "u\xcc\x88"
+		"y\xcc\x88\xcc\xa3" "c\xcc\xa7" "n\xcc\x83\xcc\x81" " ", 9 },
+	{ "Emoji",
+		// U+1F600; U+2764 VS16; U+1F44D with a skin tone modifier;
+		// U+1F469 ZWJ U+1F4BB; U+1F468 ZWJ U+1F469 ZWJ U+1F467
+		"\xf0\x9f\x98\x80" "\xe2\x9d\xa4\xef\xb8\x8f"
+		"\xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd"
+		"\xf0\x9f\x91\xa9\xe2\x80\x8d\xf0\x9f\x92\xbb"
+		"\xf0\x9f\x91\xa8\xe2\x80\x8d\xf0\x9f\x91\xa9"
+		"\xe2\x80\x8d\xf0\x9f\x91\xa7" " ", 19 },
+	{ "Mixed", "Ελληνικά Русский العربية עברית हिन्दी ไทย ", 43 },
+};
+
+// bench_unicode measures how fast the terminal processes text in various
+// scripts, each time sending the same amount of data.
+static void bench_unicode(size_t size) {
+	ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
+	int width = ws.ws_col > 1 ? ws.ws_col - 1 : 79;
+
+	enum { PAGE_LINES = 64 };
+	for (size_t i = 0; i < sizeof corpora / sizeof *corpora; i++) {
+		const struct corpus *c = &corpora[i];
+		struct buffer line = {0}, page = {0};
+		int filled = 0;
+		do {
+			buffer_append(&line, c->sample, strlen(c->sample));
+			filled += c->width;
+		} while (filled + c->width <= width);
+		buffer_append(&line, "\r\n", 2);
+		for (int k = 0; k < PAGE_LINES; k++)
+			buffer_append(&page, line.s, line.len);
+
+		size_t characters = 0;
+		for (size_t k = 0; k < page.len; k++)
+			characters += (page.s[k] & 0xc0) != 0x80;
+
+		size_t written = 0, total = 0;
+		double start = bench_start();
+		for (; written < size; written += page.len, total += characters)
+			if (!tty_write(page.s, page.len))
+				break;
+
+		double elapsed = bench_stop(start);
+		char feature[64] = "";
+		snprintf(feature, sizeof feature, "Unicode, %s", c->name);
+		printf("%-14s", c->name);
+		bench_report(feature, elapsed, written, total, "characters");
+	}
+}
+
+// A mouse decoder extracts mouse reports in any encoding from terminal input,
+// one byte at a time, so that they may span reads, and follow each other.
+struct mouse_decoder {
+	bool utf8;                          // CSI M coordinates are UTF-8 (1005)
+	enum { MD_GROUND, MD_ESC, MD_CSI, MD_X10 } state;
+	bool sgr;                           // The CSI has had a < prefix
+	bool digits;                        // The last parameter has digits
+	int len;                            // Parameters or coordinates so far
+	unsigned params[3];                 // Parameters or coordinates
+	bool wide;                          // A coordinate has taken many bytes
+	int continuation;                   // UTF-8 continuation bytes to go
+};
+
+struct mouse_event {
+	unsigned button;                    // Button number and modifier bits
+	unsigned x, y;                      // One-based position
+	bool release;                       // SGR button release
+	int encoding;                       // 1000 (X10), 1005, 1006, or 1015
+};
+
+// mouse_emit finishes a report, returning false if it is invalid.
+static bool mouse_emit(
+	struct mouse_decoder *d, struct mouse_event *ev, bool release) {
+	d->state = MD_GROUND;
+	if (d->sgr) {
+		*ev = (struct mouse_event) { d->params[0], d->params[1], d->params[2],
+			release, 1006 };
+		return true;
+	}
+
+	// Both X10 and 1015 offset the button by 32, X10 also the coordinates.
+	unsigned offset = d->len == 3 ? 32 : 0;
+	if (d->params[0] < 32 || d->params[1] < offset || d->params[2] < offset)
+		return false;
+
+	*ev = (struct mouse_event) { d->params[0] - 32,
+		d->params[1] - offset, d->params[2] - offset, false,
+		offset ? (d->wide ? 1005 : 1000) : 1015 };
+	return true;
+}
+
+// mouse_feed processes a byte of input, returning true when it completes
+// a mouse report, which is then stored in the event.
+static bool mouse_feed(
+	struct mouse_decoder *d, unsigned char c, struct mouse_event *ev) {
+	switch (d->state) {
+	case MD_GROUND:
+		if (c == '\x1b')
+			d->state = MD_ESC;
+		return false;
+	case MD_ESC:
+		if (c == '[') {
+			d->state = MD_CSI;
+			d->sgr = d->digits = d->wide = false;
+			d->len = d->continuation = 0;
+			d->params[0] = d->params[1] = d->params[2] = 0;
+		} else if (c != '\x1b') {
+			d->state = MD_GROUND;
+		}
+		return false;
+	case MD_CSI:
+		if (c == 'M' && !d->len && !d->digits && !d->sgr) {
+			d->state = MD_X10;
+		} else if (c == '<' && !d->len && !d->digits && !d->sgr) {
+			d->sgr = true;
+		} else if (c >= '0' && c <= '9') {
+			if (d->params[d->len] < 100000)
+				d->params[d->len] = d->params[d->len] * 10 + c - '0';
+			d->digits = true;
+		} else if (c == ';' && d->digits && d->len < 2) {
+			d->len++;
+			d->digits = false;
+		} else if ((c == 'M' || (c == 'm' && d->sgr)) &&
+			d->digits && d->len == 2) {
+			return mouse_emit(d, ev, c == 'm');
+		} else {
+			d->state = c == '\x1b' ? MD_ESC : MD_GROUND;
+		}
+		return false;
+	case MD_X10:
+		// 1005 only extends coordinates to two-byte UTF-8 sequences.
+		if (d->utf8 && d->continuation) {
+			d->params[d->len] = d->params[d->len] << 6 | (c & 0x3f);
+			if (--d->continuation)
+				return false;
+		} else if (d->utf8 && (c & 0xe0) == 0xc0) {
+			d->params[d->len] = c & 0x1f;
+			d->continuation = 1;
+			d->wide = true;
+			return false;
+		} else {
+			d->params[d->len] = c;
+		}
+		return ++d->len == 3 && mouse_emit(d, ev, false);
+	}
+	return false;
+}
+
+// mouse_protocol names the modes that might have produced a mouse event.
+// Without knowing the window size, 1006 and 1016 can't be told apart.
+static const char *mouse_protocol(const struct mouse_event *ev) {
+	switch (ev->encoding) {
+	case 1000:
+		return "1000/1005";
+	case 1005:
+		return "1005";
+	case 1006:
+		return ws.ws_col && ws.ws_row &&
+			(ev->x > ws.ws_col || ev->y > ws.ws_row) ? "1016" : "1006/1016";
+	default:
+		return "1015";
+	}
+}
+
+// parse_mouse recognizes a single mouse report, and describes it in a buffer.
+// Returns the modes that it might have been sent in, or NULL on failure.
+static const char *parse_mouse(const char *resp, char *buf, size_t size) {
+	// Reports longer than this must have had UTF-8 coordinates.
+	struct mouse_decoder d = { .utf8 = strlen(resp) > 6 };
+	struct mouse_event ev = {0};
+	for (const char *p = resp; *p; p++) {
+		if (mouse_feed(&d, *p, &ev)) {
+			snprintf(buf, size, "%u%s @ %u,%u",
+				ev.button, ev.release ? "m" : "", ev.x, ev.y);
+			return mouse_protocol(&ev);
+		}
+	}
+	return NULL;
+}
+
+// mouse_print decodes and prints out all mouse reports within a response.
+// Returns the modes that the first one might have been sent in, or NULL.
+static const char *mouse_print(struct mouse_decoder *d, const char *resp) {
+	const char *protocol = NULL;
+	struct mouse_event ev = {0};
+	for (const char *p = resp; *p; p++) {
+		if (!mouse_feed(d, *p, &ev))
+			continue;
+		if (!protocol)
+			protocol = mouse_protocol(&ev);
+		printf("%s (%u%s @ %u,%u)\n", mouse_protocol(&ev),
+			ev.button, ev.release ? "m" : "", ev.x, ev.y);
+	}
+	return protocol;
+}
+
+// test_mouse tests whether a particular mouse mode is supported.
+// All reports that come in get decoded, including button releases.
+static void test_mouse(int mode) {
+	ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
+	tty_puts(CSI "?1002l" CSI "?1003l" CSI "?1005l"
+		CSI "?1006l" CSI "?1015l" CSI "?1016l" CSI "?1000h");
+
+	char buf[100] = "";
+	snprintf(buf, sizeof buf, CSI "?%dh" "%d: ", mode, mode);
+	char *resp = comm(buf, true);
+
+	// Beware that this isn't compatible with xterm run with the -lc switch.
+	struct mouse_decoder d = { .utf8 = mode == 1005 };
+	const char *protocol = mouse_print(&d, resp);
+	if (!protocol)
+		printf("Failed to parse.\n");
+
+	snprintf(buf, sizeof buf, "Mouse %d", mode);
+	result_comm(buf, resp, protocol);
+
+	resp = comm("Waiting for button up events, press a key if hanging.\n",
+		true);
+	mouse_print(&d, resp);
+}
+
+// bench_mouse measures how fast mouse reports in all encodings are decoded.
+// This doesn't involve the terminal, it only shows what floods of reports
+// cost to process on our side.
+static void bench_mouse(size_t size) {
+	struct buffer sample = {0};
+	for (int i = 0; i < 1024; i++) {
+		char report[32] = "";
+		int button = 32 + i % 4, x = i % 200 + 1, y = i % 50 + 1;
+		if (i % 3 == 0)
+			snprintf(report, sizeof report, CSI "<%d;%d;%dM", button, x, y);
+		else if (i % 3 == 1)
+			snprintf(report, sizeof report, CSI "%d;%d;%dM", button + 32, x, y);
+		else
+			snprintf(report, sizeof report, CSI "M%c%c%c",
+				button + 32, x % 90 + 33, y + 32);
+		buffer_append(&sample, report, strlen(report));
+	}
+
+	struct mouse_decoder d = {0};
+	struct mouse_event ev = {0};
+	size_t done = 0, events = 0;
+	double start = clock_msec();
+	for (; done < size; done += sample.len)
+		for (size_t i = 0; i < sample.len; i++)
+			events += mouse_feed(&d, sample.s[i], &ev);
+	bench_report("Mouse decoding", clock_msec() - start, done, events,
+		"events");
+}
+
+// bench_motion records SGR mouse motion reports while the user moves
+// the pointer around, and finds out how regularly they arrive. Reports that
+// skip over cells suggest that the terminal coalesces motion events.
+// As in test_focus(), gaps are measured between reads that carry reports.
+// A key press ends the measurement early.
+static void bench_motion() {
+	// Leave at least half of the time budget to whatever follows.
+	double window = 5000 /* milliseconds */;
+	if (deadline && (deadline - clock_msec()) / 2 < window)
+		window = (deadline - clock_msec()) / 2;
+
+	tty_puts(CSI "?1003h" CSI "?1006h");
+	printf("Keep moving the pointer around the window for %.0f seconds,"
+		" or press a key to stop.\n", window / 1000);
+
+	// The first report starts the clock.
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	poll(&pfd, 1, -1);
+
+	struct samples gaps = {0};
+	struct mouse_decoder d = {0};
+	struct mouse_event ev = {0};
+	struct scanner sc = { .state = SC_GROUND };
+	struct buffer buf = {0};
+	size_t events = 0, reads = 0, skips = 0, repeats = 0;
+	size_t bursts = 0, burst_reports = 0;
+	double start = clock_msec(), first = 0, last = 0, elapsed = 0;
+	int last_x = -1, last_y = -1;
+	bool stop = false;
+	ssize_t len = 0;
+	while (!stop && (elapsed = clock_msec() - start) < window &&
+		(len = tty_read(&buf, window - elapsed)) > 0) {
+		double now = clock_msec();
+		size_t reports = 0;
+		for (size_t i = 0; i < buf.len; i++) {
+			// Anything but a control sequence must have come from the keyboard.
+			if (sc.state == SC_GROUND && buf.s[i] != 0x1b)
+				stop = true;
+			scanner_feed(&sc, buf.s[i]);
+			if (!mouse_feed(&d, buf.s[i], &ev) || !(ev.button & 32))
+				continue;
+
+			int x = ev.x, y = ev.y;
+			if (!events++)
+				first = now;
+			if (last_x == x && last_y == y)
+				repeats++;
+			else if (last_x >= 0 &&
+				(abs(last_x - x) > 1 || abs(last_y - y) > 1))
+				skips++;
+			last_x = x;
+			last_y = y;
+			reports++;
+		}
+		buf.len = 0;
+		if (!reports)
+			continue;
+
+		if (reads++)
+			samples_add(&gaps, now - last);
+		if (reports > 1) {
+			bursts++;
+			burst_reports += reports;
+		}
+		last = now;
+	}
+
+	// Swallow any reports that were still on their way.
+	tty_puts(CSI "?1006l" CSI "?1003l");
+	fence();
+
+	// Jitter is the mean absolute deviation of gaps between reads.
+	double mean = 0, jitter = 0;
+	for (size_t i = 0; i < gaps.len; i++)
+		mean += gaps.v[i] / gaps.len;
+	for (size_t i = 0; i < gaps.len; i++) {
+		double deviation = gaps.v[i] - mean;
+		jitter += (deviation < 0 ? -deviation : deviation) / gaps.len;
+	}
+
+	// Only the time that the pointer has actually been moving counts.
+	char value[64] = "";
+	if (last > first)
+		snprintf(value, sizeof value, "%.1f events/s",
+			(events - 1) / ((last - first) / 1000));
+	printf("%zu motion events in %zu reads", events, reads);
+	if (*value)
+		printf(": %s", value);
+	printf("\n");
+	result("Mouse motion, rate", NULL, *value ? value : NULL, -1, 0, 0);
+
+	snprintf(value, sizeof value, "%zu reports in %zu reads",
+		burst_reports, bursts);
+	printf("%-14s%s\n", "Bursts:", value);
+	result("Mouse motion, bursts", NULL, value, -1, 0, 0);
+
+	printf("%-14s", "Gaps:");
+	samples_print("Mouse motion, gap", &gaps);
+	snprintf(value, sizeof value, "%.3f ms", jitter);
+	printf("%-14s%s\n", "Jitter:", value);
+	result("Mouse motion, jitter", NULL, value, -1, 0, 0);
+
+	// Repeated positions are fine, they come from sub-cell movement.
+	snprintf(value, sizeof value, "%.1f %%", events > 1 ? 100. * skips /
+		(events - 1) : 0);
+	printf("%-14s%s of reports skip cells, %zu repeat the position\n",
+		"Coalescing:", value, repeats);
+	result("Mouse motion, skipped cells", NULL, value, -1, 0, 0);
+}
+
+// test_focus decodes all focus reports until a key is pressed, including
+// those that arrive in bursts, and finds out how closely they may follow
+// each other. Reports within a single read can't be told apart in time,
+// so they are only counted, and gaps are measured between reads.
+static void test_focus() {
+	printf("Focus in and out of the window, press a key to abort.\n");
+
+	struct samples gaps = {0};
+	struct scanner sc = { .state = SC_GROUND };
+	struct buffer buf = {0};
+	size_t ins = 0, outs = 0, toggles = 0, bursts = 0, burst_reports = 0;
+	double start = clock_msec(), last = -1;
+	char state = 0;
+	bool stop = false;
+	ssize_t len = 0;
+	while (!stop && (len = tty_read(&buf, -1)) > 0) {
+		double now = clock_msec();
+		size_t token = 0, reports = 0;
+		for (size_t i = buf.len - len; i < buf.len; i++) {
+			if (!scanner_feed(&sc, buf.s[i]))
+				continue;
+
+			const char *t = buf.s + token;
+			size_t t_len = i + 1 - token;
+			token = i + 1;
+			if (*t != '\x1b') {
+				stop = true;
+				continue;
+			}
+			if (t_len != 3 || t[1] != '[' || (t[2] != 'I' && t[2] != 'O'))
+				continue;
+
+			reports++;
+
+			// Repeated reports of the same state aren't toggles.
+			toggles += state && state != t[2];
+			state = t[2];
+			if (state == 'I')
+				ins++;
+			else
+				outs++;
+			printf("%-14s+%.3f ms\n", state == 'I' ? "Focused in." :
+				"Focused out.", now - start);
+		}
+		if (reports > 1) {
+			bursts++;
+			burst_reports += reports;
+		}
+		if (reports && last >= 0)
+			samples_add(&gaps, now - last);
+		if (reports)
+			last = now;
+		memmove(buf.s, buf.s + token, buf.len - token + 1);
+		buf.len -= token;
+	}
+
+	char value[64] = "";
+	snprintf(value, sizeof value, "%zu in, %zu out, %zu toggles",
+		ins, outs, toggles);
+	printf("%s\n", value);
+	result("Focus, reports", NULL, value, -1, 0, 0);
+
+	snprintf(value, sizeof value, "%zu reports in %zu reads",
+		burst_reports, bursts);
+	printf("%-14s%s\n", "Bursts:", value);
+	result("Focus, bursts", NULL, value, -1, 0, 0);
+
+	// samples_print() sorts the series, so the shortest gap comes first.
+	printf("%-14s", "Gaps:");
+	samples_print("Focus, gap", &gaps);
+	if (gaps.len) {
+		snprintf(value, sizeof value, "%.3f ms", gaps.v[0]);
+		result("Focus, shortest gap", NULL, value, gaps.v[0], 0, 0);
+	}
+}
+
+// base64_encode appends the Base64 encoding of data to the buffer.
+static void base64_encode(struct buffer *b, const char *data, size_t len) {
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char *p = buffer_reserve(b, (len + 2) / 3 * 4);
+	const unsigned char *s = (const unsigned char *) data;
+	for (size_t i = 0; i < len; i += 3) {
+		uint32_t v = s[i] << 16;
+		if (i + 1 < len)
+			v |= s[i + 1] << 8;
+		if (i + 2 < len)
+			v |= s[i + 2];
+
+		*p++ = alphabet[v >> 18 & 63];
+		*p++ = alphabet[v >> 12 & 63];
+		*p++ = i + 1 < len ? alphabet[v >> 6 & 63] : '=';
+		*p++ = i + 2 < len ? alphabet[v & 63] : '=';
+	}
+	b->s[b->len = p - b->s] = 0;
+}
+
+// base64_decode appends decoded Base64 data to the buffer, tolerating
+// line breaks and missing padding. Returns false if it fails to validate.
+static bool base64_decode(struct buffer *b, const char *s, size_t len) {
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char *p = buffer_reserve(b, len / 4 * 3 + 3);
+	uint32_t v = 0;
+	int bits = 0;
+	for (size_t i = 0; i < len && s[i] != '='; i++) {
+		const char *c = s[i] ? strchr(alphabet, s[i]) : NULL;
+		if (!c && strchr("\r\n\t ", s[i]))
+			continue;
+		if (!c)
+			return false;
+
+		v = v << 6 | (c - alphabet);
+		if ((bits += 6) >= 8)
+			*p++ = v >> (bits -= 8);
+	}
+	b->s[b->len = p - b->s] = 0;
+	return true;
+}
+
+// paste_payload makes up a log of the given size to be pasted back,
+// with tabs and UTF-8 in it, so that filtering can be told apart.
+static char *paste_payload(size_t size) {
+	char *payload = calloc(1, size + 1), line[128] = "";
+	size_t len = 0;
+	for (unsigned long i = 0; len < size; i++) {
+		int n = snprintf(line, sizeof line, "%08lu\tINFO\tpaste test, "
+			"žluťoučký kůň, seq=%lu\n",
+			i, i * 2654435761ul % 1000003);
+		memcpy(payload + len, line, len + n > size ? size - len : (size_t) n);
+		len += n;
+	}
+	return payload;
+}
+
+// A paste_digest summarizes pasted data, so that it needn't be kept around.
+struct paste_digest {
+	size_t len;                         // Number of bytes
+	size_t newlines;                    // Number of line endings
+	uint64_t hash;                      // FNV-1a of the data as received
+	uint64_t hash_lf;                   // FNV-1a with CR translated to LF
+};
+
+// paste_digest_feed adds a byte of pasted data to the digest.
+static void paste_digest_feed(struct paste_digest *d, unsigned char c) {
+	d->len++;
+	d->hash = (d->hash ^ c) * FNV_PRIME;
+	if (c == '\r' || c == '\n')
+		d->newlines++;
+	d->hash_lf = (d->hash_lf ^ (c == '\r' ? '\n' : c)) * FNV_PRIME;
+}
+
+// clipboard_round_trip sets the clipboard to the payload through OSC 52,
+// reads it back, and returns whether it has come back unchanged.
+// The elapsed time is stored in ms, or -1 if the terminal hasn't replied.
+static bool clipboard_round_trip(const char *payload, size_t size, double *ms) {
+	struct buffer req = {0};
+	buffer_append(&req, OSC "52;c;", 7);
+	base64_encode(&req, payload, size);
+	buffer_append(&req, BEL OSC "52;c;?" BEL CSI "c", 13);
+
+	double start = clock_msec();
+	*ms = -1;
+	if (!tty_write(req.s, req.len))
+		return false;
+
+	// Terminals may take their time to process large selections.
+	int lag = response_timeout() + (size >> 12);
+	struct scanner sc = { .state = SC_GROUND };
+	struct buffer resp = {0}, decoded = {0};
+	bool match = false, fenced = false;
+	size_t token = 0;
+	ssize_t len = 0;
+	while (!fenced && (len = tty_read(&resp, lag)) > 0) {
+		for (size_t i = resp.len - len; !fenced && i < resp.len; i++) {
+			if (!scanner_feed(&sc, resp.s[i]))
+				continue;
+
+			const char *t = resp.s + token, *end = resp.s + i + 1;
+			token = i + 1;
+			if (end - t > 5 && !strncmp(t, OSC "52;", 5)) {
+				// Skip the selection parameter, and strip the terminator.
+				const char *b64 = memchr(t + 5, ';', end - t - 5);
+				if (end[-1] == '\\')
+					end--;
+				end--;
+				decoded.len = 0;
+				match = b64 &&
+					base64_decode(&decoded, b64 + 1, end - b64 - 1) &&
+					decoded.len == size && !memcmp(decoded.s, payload, size);
+			} else if (end - t > 3 && !strncmp(t, CSI "?", 3) &&
+				end[-1] == 'c') {
+				fenced = true;
+				*ms = clock_msec() - start;
+			}
+		}
+		memmove(resp.s, resp.s + token, resp.len - token + 1);
+		resp.len -= token;
+		token = 0;
+	}
+
+	// Repeated with ever larger selections, these would add up.
+	free(req.s);
+	free(resp.s);
+	free(decoded.s);
+	return match;
+}
+
+// bench_paste puts a known log onto the clipboard, has the user paste it,
+// and reads the bracketed paste in a streaming fashion, however large,
+// to find out how fast it arrives, and whether it has arrived intact.
+// The latter can only be judged if the clipboard can be read back.
+static void bench_paste(size_t size) {
+	char *payload = paste_payload(size);
+	struct paste_digest expected = { .hash = FNV_OFFSET,
+		.hash_lf = FNV_OFFSET };
+	for (size_t i = 0; i < size; i++)
+		paste_digest_feed(&expected, payload[i]);
+
+	double round_trip = -1;
+	bool known = clipboard_round_trip(payload, size, &round_trip);
+	if (known)
+		printf("The clipboard now contains a %zu byte log.\n", size);
+	else
+		printf("The clipboard should now contain a %zu byte log,"
+			" but it couldn't be read back.\n", size);
+
+	static const char paste_end[] = CSI "201~";
+	struct paste_digest got = { .hash = FNV_OFFSET, .hash_lf = FNV_OFFSET };
+	struct scanner sc = { .state = SC_GROUND };
+	struct buffer buf = {0};
+	size_t pastes = 0;
+	double first = -1, end = -1;
+	bool bracketed = false, done = false;
+	ssize_t len = 0;
+	tty_puts(CSI "?2004h" "Paste something: ");
+
+	// Some terminals split large pastes, so allow for more of them.
+	while (!done && (len = tty_read(&buf, bracketed ? 250 : -1)) > 0) {
+		double now = clock_msec();
+		for (ssize_t i = 0; !done && i < len; i++) {
+			unsigned char c = buf.s[i];
+			if (sc.state != SC_PASTE) {
+				if (scanner_feed(&sc, c)) {
+					done = true;
+				} else if (sc.state == SC_PASTE) {
+					bracketed = true;
+					pastes++;
+					if (first < 0)
+						first = now;
+				}
+				continue;
+			}
+
+			// Only once the end sequence fails to match is it pasted data.
+			size_t matched = sc.paste_match;
+			if (scanner_feed(&sc, c)) {
+				end = now;
+				continue;
+			}
+			if (sc.paste_match == matched + 1)
+				continue;
+			for (size_t k = 0; k < matched; k++)
+				paste_digest_feed(&got, paste_end[k]);
+			if (!sc.paste_match)
+				paste_digest_feed(&got, c);
+		}
+		buf.len = 0;
+	}
+	tty_puts(CSI "?2004l");
+
+	// Keep the rest of an unbracketed paste from spilling over.
+	while (tty_read(&buf, 100) > 0)
+		buf.len = 0;
+
+	printf("\n");
+	result("Bracketed paste", NULL, bracketed ? "1" : "0", -1, 0, 0);
+	if (!bracketed) {
+		printf("Not bracketed.\n");
+		return;
+	}
+
+	const char *verdict = NULL;
+	if (!known)
+		verdict = "payload unknown";
+	else if (got.len == expected.len && got.hash == expected.hash)
+		verdict = "intact";
+	else if (got.len == expected.len && got.hash_lf == expected.hash_lf)
+		verdict = "intact, LF as CR";
+	else if (got.len < expected.len)
+		verdict = "truncated or filtered";
+	else if (got.len > expected.len)
+		verdict = "expanded";
+	else
+		verdict = "mangled";
+
+	// The terminal driver's ICRNL normally undoes CR translation for us.
+	if (known)
+		printf("%zu bytes in %zu paste(s), of %zu expected: %s\n",
+			got.len, pastes, expected.len, verdict);
+	else
+		printf("%zu bytes in %zu paste(s): %s\n", got.len, pastes, verdict);
+	result("Bracketed paste, integrity", NULL, verdict, -1, 0, got.len);
+	if (pastes > 1) {
+		char value[32] = "";
+		snprintf(value, sizeof value, "%zu", pastes);
+		result("Bracketed paste, split", NULL, value, -1, 0, 0);
+	}
+	if (end < 0) {
+		printf("The paste hasn't been terminated.\n");
+		result("Bracketed paste, throughput", NULL, NULL, -1, 0, got.len);
+		return;
+	}
+
+	// A paste that has arrived in a single read can't be timed.
+	double ms = end - first, mib = got.len / 1048576.;
+	char value[64] = "";
+	if (ms > 0)
+		snprintf(value, sizeof value, "%.2f MiB/s", mib / ms * 1000);
+	printf("%.2f MiB, %zu lines, first to last byte in %.1f ms: %s\n",
+		mib, got.newlines, ms, *value ? value : "a single read");
+	result("Bracketed paste, throughput", NULL, *value ? value : NULL,
+		ms, 0, got.len);
+}
+
+// bench_clipboard sets OSC 52 selections of growing size, up to the limit,
+// and reads them back, so as to find out how large they may get,
+// and how fast they are.
+static void bench_clipboard(size_t limit) {
+	char *payload = paste_payload(limit);
+	size_t largest = 0;
+	for (size_t size = 1 << 10; size <= limit; size <<= 1) {
+		double ms = -1;
+		bool match = clipboard_round_trip(payload, size, &ms);
+
+		char feature[64] = "", value[64] = "";
+		snprintf(feature, sizeof feature, "OSC 52, %zu KiB", size >> 10);
+		if (match && ms > 0)
+			snprintf(value, sizeof value, "%.2f MiB/s",
+				size / 1048576. / ms * 1000);
+		else if (match)
+			snprintf(value, sizeof value, "match");
+
+		printf("%8zu KiB: ", size >> 10);
+		if (ms < 0)
+			printf("the terminal has stopped responding\n");
+		else if (!match)
+			printf("didn't come back unchanged, in %.1f ms\n", ms);
+		else
+			printf("round trip in %.1f ms, %s\n", ms, value);
+		result(feature, NULL, match ? value : NULL, ms, 0, 0);
+		if (!match)
+			break;
+		largest = size;
+	}
+
+	// Anything still to come would get mistaken for later responses.
+	struct buffer drain = {0};
+	while (tty_read(&drain, response_timeout()) > 0)
+		drain.len = 0;
+	free(drain.s);
+	free(payload);
+
+	char value[64] = "";
+	if (largest)
+		snprintf(value, sizeof value, "%zu KiB", largest >> 10);
+	printf("Largest round trip: %s\n", largest ? value : "none");
+	result("OSC 52, largest", NULL, largest ? value : NULL, -1, 0, 0);
+}
+
+// parse_decrpss checks a DECRPSS sequence and cuts out the inner part.
+// Returns NULL if it fails to validate.
+static char *parse_decrpss(char *resp) {
+	if (!resp || strncmp(resp, DCS "1$r", 5))
+		return NULL;
+
+	*strpbrk(resp + 5, BEL ST8 "\x1b") = 0;
+	return resp + 5;
+}
+
+// probe_decrpss is parse_decrpss() for a batched query, also reporting it.
+static char *probe_decrpss(const char *feature, struct query *q) {
+	struct query original = *q;
+	if (q->resp)
+		original.resp = strdup(q->resp);
+
+	char *value = parse_decrpss(q->resp);
+	result_query(feature, &original, value);
+	return value;
+}
+
+// parse_string returns a copy of the contents of a control string response
+// with the given prefix. Returns NULL if it fails to validate.
+static char *parse_string(const char *resp, const char *prefix) {
+	if (!resp || strncmp(resp, prefix, strlen(prefix)))
+		return NULL;
+
+	char *copy = strdup(resp + strlen(prefix)), *end = NULL;
+	if ((end = strpbrk(copy, BEL ST8 "\x1b")))
+		*end = 0;
+	return copy;
+}
+
+// parse_da2 extracts the terminal type and firmware version from a DA2
+// response. Returns false if it fails to validate.
+static bool parse_da2(const char *resp, long *type, long *version) {
+	if (!resp || strncmp(resp, CSI ">", 3))
+		return false;
+
+	char *end = NULL;
+	*type = strtol(resp + 3, &end, 10);
+	if (end == resp + 3 || *end != ';')
+		return false;
+	*version = strtol(end + 1, &end, 10);
+	return *end == ';' || *end == 'c';
+}
+
+// da2_name returns what is known to report a particular DA2 terminal type.
+// Plain DEC models are claimed by many emulators, e.g., VT220 by Konsole.
+static const char *da2_name(long type) {
+	switch (type) {
+	case 0:
+		return "VT100";
+	case 1:
+		return "VT220";
+	case 2:
+		return "VT240";
+	case 18:
+		return "VT330";
+	case 19:
+		return "VT340";
+	case 24:
+		return "VT320";
+	case 41:
+		return "xterm";
+	case 61:
+		return "VT510";
+	case 64:
+		return "VT520";
+	case 65:
+		return "VTE";
+	case 'C':
+		return "Cygwin";
+	case 'M':
+		return "mintty";
+	case 'R':
+		return "rxvt";
+	case 'S':
+		return "GNU Screen";
+	case 'T':
+		return "tmux";
+	case 'U':
+		return "rxvt-unicode";
+	default:
+		return NULL;
+	}
+}
+
+// da3_text decodes a hexadecimal DA3 unit ID, if it consists of printable
+// characters, which VTE, for one, makes use of. Returns NULL otherwise.
+static char *da3_text(const char *hex) {
+	size_t len = strlen(hex);
+	if (!len || len % 2)
+		return NULL;
+
+	char *text = calloc(1, len / 2 + 1);
+	for (size_t i = 0; i < len / 2; i++) {
+		unsigned int c = 0;
+		if (!isxdigit(hex[2 * i]) || !isxdigit(hex[2 * i + 1]) ||
+			sscanf(hex + 2 * i, "%2x", &c) != 1 || c < 32 || c >= 127)
+			return NULL;
+		text[i] = c;
+	}
+	return text;
+}
+
+// colour prints a cell with the given indexed colour as a background.
+static void colour(int n) {
+	n > 7 ? printf(CSI "48;5;%dm ", n) : printf(CSI "%dm ", 40 + n);
+}
+
+// direct prints a cell with the given direct colour as a background.
+// sep can be set either to ':' for ISO-8613-6 or ';' for more compatibility.
+static void direct(char sep, int r, int g, int b) {
+	printf(CSI "48%c2%c%d%c%d%c%dm ", sep, sep, r, sep, g, sep, b);
+}
+
+// Benchmarks keep all of their data in memory, so keep them within reason.
+enum { BENCH_MAX_MIB = 4096 };
+
+// parse_mib converts a benchmark size in MiB to bytes.
+// Returns zero if it is invalid, or out of range.
+static size_t parse_mib(const char *s) {
+	char *end = NULL;
+	errno = 0;
+	unsigned long mib = strtoul(s, &end, 10);
+	if (!isdigit(*s) || *end || errno || !mib || mib > BENCH_MAX_MIB)
+		return 0;
+	return (size_t) mib << 20;
+}
+
+// A script rule makes the harness reply whenever the output contains a pattern.
+struct rule {
+	char *pattern, *reply;
+	size_t pattern_len, reply_len;
+};
+
+// A script is a list of rules, plus enough output to match across reads.
+struct script {
+	struct rule *rules;
+	size_t len;
+	size_t longest;                     // Length of the longest pattern
+	struct buffer tail;                 // Output that hasn't been matched yet
+};
+
+// unescape resolves C-like escape sequences, plus \e for ESC, in place.
+// Returns the resulting length, as the string may contain NULs.
+static size_t unescape(char *s) {
+	char *start = s, *out = s;
+	for (; *s; s++) {
+		if (*s != '\\' || !s[1]) {
+			*out++ = *s;
+			continue;
+		}
+
+		switch (*++s) {
+		case 'a': *out++ = '\a'; break;
+		case 'e': *out++ = '\x1b'; break;
+		case 'n': *out++ = '\n'; break;
+		case 'r': *out++ = '\r'; break;
+		case 't': *out++ = '\t'; break;
+		case 'x': {
+			char hex[3] = { s[1], s[1] ? s[2] : 0, 0 }, *end = NULL;
+			*out++ = strtol(hex, &end, 16);
+			s += end - hex;
+			break;
+		}
+		default:
+			*out++ = *s;
+		}
+	}
+	*out = 0;
+	return out - start;
+}
+
+// script_load reads rules, one per line, in the form PATTERN<Tab>REPLY,
+// both of which may contain escape sequences. Lines starting with # and
+// lines without a tab are ignored.
+static bool script_load(struct script *sc, const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return false;
+
+	// Replies may simulate large pastes, so lines aren't length-limited.
+	char *line = NULL;
+	size_t alloc = 0;
+	while (getline(&line, &alloc, fp) >= 0) {
+		line[strcspn(line, "\n")] = 0;
+		char *sep = strchr(line, '\t');
+		if (*line == '#' || !sep || sep == line)
+			continue;
+
+		*sep = 0;
+		struct rule r = { .pattern = strdup(line), .reply = strdup(sep + 1) };
+		r.pattern_len = unescape(r.pattern);
+		r.reply_len = unescape(r.reply);
+		if (r.pattern_len > sc->longest)
+			sc->longest = r.pattern_len;
+
+		sc->rules = realloc(sc->rules, sizeof *sc->rules * (sc->len + 1));
+		sc->rules[sc->len++] = r;
+	}
+	fclose(fp);
+	return true;
+}
+
+// script_respond finds all patterns in new output, and appends
+// the respective replies in the order the patterns have appeared.
+static void script_respond(
+	void *ctx, const char *data, size_t len, struct buffer *replies) {
+	struct script *sc = ctx;
+	size_t old = sc->tail.len;
+	buffer_append(&sc->tail, data, len);
+
+	// Only look at matches that end within the new data.
+	for (size_t i = 0; i < sc->tail.len; i++) {
+		for (size_t k = 0; k < sc->len; k++) {
+			const struct rule *r = &sc->rules[k];
+			size_t end = i + r->pattern_len;
+			if (end > old && end <= sc->tail.len &&
+				!memcmp(sc->tail.s + i, r->pattern, r->pattern_len))
+				buffer_append(replies, r->reply, r->reply_len);
+		}
+	}
+
+	size_t keep = sc->longest ? sc->longest - 1 : 0;
+	if (sc->tail.len > keep) {
+		memmove(sc->tail.s, sc->tail.s + sc->tail.len - keep, keep + 1);
+		sc->tail.len = keep;
+	}
+}
+
+// A responder gets all output of the program running within the harness,
+// and appends any replies to the buffer.
+typedef void (*responder_fn)(
+	void *ctx, const char *data, size_t len, struct buffer *replies);
+
+// The size of the harness pseudoterminal. The mouse protocol test needs
+// the terminal to be at least 223 columns wide.
+enum { HARNESS_ROWS = 60, HARNESS_COLS = 240 };
+
+// How long the child may stay silent, in milliseconds, before it is assumed
+// to be stuck on a prompt that nothing is going to reply to.
+enum { HARNESS_IDLE = 10000 };
+
+// harness_start moves the program onto a new pseudoterminal. The child process
+// attached to its slave side gets -1, while the parent gets the master side.
+static int harness_start(pid_t *child) {
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) || unlockpt(master))
+		abort();
+
+	struct winsize size = { .ws_row = HARNESS_ROWS, .ws_col = HARNESS_COLS };
+	ioctl(master, TIOCSWINSZ, &size);
+
+	const char *slave_path = ptsname(master);
+	if ((*child = fork()) < 0)
+		abort();
+	if (*child)
+		return master;
+
+	int slave = -1;
+	if (setsid() < 0 || (slave = open(slave_path, O_RDWR)) < 0)
+		abort();
+	ioctl(slave, TIOCSCTTY, 0);
+	dup2(slave, STDIN_FILENO);
+	dup2(slave, STDOUT_FILENO);
+	dup2(slave, STDERR_FILENO);
+	close(slave);
+	close(master);
+
+	// There is no X11 window to draw pictures into.
+	unsetenv("WINDOWID");
+	setenv("TERM", "xterm-256color", false);
+	return -1;
+}
+
+// harness_text extracts plain text from the child's output, so that queries
+// and mode changes don't reach whatever terminal we are running in.
+// The current line is kept in the buffer, and finished ones get echoed.
+static void harness_text(struct scanner *sc, bool *text, struct buffer *line,
+	const char *buf, size_t len, bool echo) {
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+		if (sc->state == SC_GROUND)
+			*text = c != 0x1b;
+		scanner_feed(sc, c);
+		if (!*text || (c < 0x20 && c != '\n' && c != '\t') || c == 0x7f)
+			continue;
+
+		if (echo)
+			putchar(c);
+		if (c == '\n')
+			line->len = 0;
+		else
+			buffer_append(line, &c, 1);
+	}
+}
+
+// harness_run feeds all output of the child to the responder, optionally
+// copying its text to our standard output as well, and returns its exit
+// status. A child that stays silent for too long gets killed.
+static int harness_run(
+	int master, pid_t child, responder_fn respond, void *ctx, bool echo) {
+	char buf[65536];
+	ssize_t len = 0;
+	struct buffer replies = {0}, line = {0};
+	struct scanner sc = { .state = SC_GROUND };
+	bool text = true;
+	struct pollfd pfd = { .fd = master, .events = POLLIN };
+	while (true) {
+		int ready = poll(&pfd, 1, HARNESS_IDLE);
+		if (ready < 0 && errno == EINTR)
+			continue;
+		if (!ready) {
+			fflush(stdout);
+			fprintf(stderr, "Nothing has replied to: %s\n",
+				line.len ? line.s : "(no text)");
+			kill(child, SIGKILL);
+			waitpid(child, NULL, 0);
+			return EXIT_FAILURE;
+		}
+		if (ready < 0)
+			break;
+		if ((len = read(master, buf, sizeof buf)) < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+
+		harness_text(&sc, &text, &line, buf, len, echo);
+
+		replies.len = 0;
+		respond(ctx, buf, len, &replies);
+		for (size_t i = 0; i < replies.len; ) {
+			ssize_t n = write(master, replies.s + i, replies.len - i);
+			if (n < 0 && errno != EINTR)
+				break;
+			i += n > 0 ? n : 0;
+		}
+	}
+
+	// Reading fails with EIO once the slave side has been closed.
+	int status = 0;
+	fflush(stdout);
+	waitpid(child, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+// An emulator is a small reference terminal, serving as a fast and
+// deterministic baseline. It keeps a grid of characters, and responds to
+// queries like a real terminal would. Every character is one cell wide,
+// as we're not in the business of measuring wcwidth().
+struct emulator {
+	struct script *script;              // Additional rules, or NULL
+	int rows, cols;                     // Screen dimensions
+	uint32_t **grid, **alt_grid;        // Characters on both screens
+	bool alt;                           // The alternate screen is shown
+	struct buffer scrollback;           // Lines scrolled off the main screen
+
+	int x, y;                           // Cursor position, zero-based
+	bool wrap_pending;                  // Past the last column, DECAWM-style
+	int saved_x, saved_y;               // Saved cursor position
+	int top, bottom;                    // Scrolling region, inclusive
+	int cursor_style;                   // DECSCUSR parameter
+	int set_modes[64];                  // Set modes, ANSI ones negated
+	size_t set_modes_len;
+
+	unsigned attrs;                     // Bit n means SGR n, 53 is bit 10
+	int fg, bg, ul;                     // Colours: -1, index, or EM_RGB|rgb
+	uint32_t palette[256];              // Indexed colours
+	char *clipboard;                    // Base64-encoded OSC 52 selection
+
+	enum { EM_GROUND, EM_ESC, EM_CSI, EM_STRING, EM_STRING_ESC } state;
+	struct buffer seq;                  // The control sequence being parsed
+	uint32_t cp;                        // The UTF-8 character being decoded
+	int continuation;                   // Its continuation bytes to go
+};
+
+enum { EM_RGB = 1 << 24, EM_OVERLINE = 10 };
+
+// emulator_default_colour returns xterm's default for an indexed colour.
+static uint32_t emulator_default_colour(int index) {
+	static const uint32_t base[16] = {
+		0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd,
+		0x00cdcd, 0xe5e5e5, 0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00,
+		0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff,
+	};
+	if (index < 16)
+		return base[index];
+	if (index >= 232)
+		return (8 + (index - 232) * 10) * 0x010101;
+
+	int i = index - 16, r = i / 36, g = i / 6 % 6, b = i % 6;
+	return (r ? r * 40 + 55 : 0) << 16 |
+		(g ? g * 40 + 55 : 0) << 8 | (b ? b * 40 + 55 : 0);
+}
+
+// emulator_palette resets indexed colours to xterm's defaults.
+static void emulator_palette(struct emulator *e) {
+	for (int i = 0; i < 256; i++)
+		e->palette[i] = emulator_default_colour(i);
+}
+
+// emulator_init prepares a blank emulator of the given dimensions.
+static void emulator_init(struct emulator *e, int rows, int cols) {
+	*e = (struct emulator) { .rows = rows, .cols = cols,
+		.bottom = rows - 1, .fg = -1, .bg = -1, .ul = -1,
+		.set_modes = { 7, 25 }, .set_modes_len = 2 };
+	e->grid = malloc(sizeof *e->grid * rows);
+	e->alt_grid = malloc(sizeof *e->alt_grid * rows);
+	for (int y = 0; y < rows; y++) {
+		e->grid[y] = malloc(sizeof **e->grid * cols);
+		e->alt_grid[y] = malloc(sizeof **e->alt_grid * cols);
+		for (int x = 0; x < cols; x++)
+			e->grid[y][x] = e->alt_grid[y][x] = ' ';
+	}
+	emulator_palette(e);
+}
+
+// emulator_erase blanks out a range of cells, in screen order.
+static void emulator_erase(struct emulator *e, int from, int to) {
+	while (from < to) {
+		int y = from / e->cols, x = from % e->cols, end = to - y * e->cols;
+		if (end > e->cols)
+			end = e->cols;
+		for (uint32_t *line = e->grid[y]; x < end; x++)
+			line[x] = ' ';
+		from = y * e->cols + end;
+	}
+}
+
+// utf8_encode writes out a character, returning the number of bytes.
+static int utf8_encode(char *p, uint32_t cp) {
+	if (cp < 0x80) {
+		p[0] = cp;
+		return 1;
+	}
+
+	static const unsigned char lead[] = { 0, 0, 0xc0, 0xe0, 0xf0 };
+	int len = cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+	for (int i = len; --i; cp >>= 6)
+		p[i] = 0x80 | (cp & 0x3f);
+	p[0] = lead[len] | cp;
+	return len;
+}
+
+// emulator_line appends a screen line to a buffer as text.
+static void emulator_line(struct emulator *e, int y, struct buffer *out) {
+	const uint32_t *line = e->grid[y];
+	int len = e->cols;
+	while (len && line[len - 1] == ' ')
+		len--;
+	for (int x = 0; x < len; x++)
+		out->len += utf8_encode(buffer_reserve(out, 4), line[x]);
+	buffer_append(out, "\n", 1);
+}
+
+// emulator_scroll moves lines within the scrolling region by n lines,
+// upwards if n is positive, and downwards otherwise. Only line pointers
+// get rotated, like in any terminal that cares about its performance.
+static void emulator_scroll(struct emulator *e, int n) {
+	int height = e->bottom - e->top + 1, w = e->cols;
+	if (n > height)
+		n = height;
+	if (n < -height)
+		n = -height;
+
+	uint32_t *freed[n < 0 ? -n : n + 1], **region = e->grid + e->top;
+	if (n > 0) {
+		memcpy(freed, region, sizeof *freed * n);
+		memmove(region, region + n, sizeof *region * (height - n));
+		memcpy(region + height - n, freed, sizeof *freed * n);
+		emulator_erase(e, (e->bottom + 1 - n) * w, (e->bottom + 1) * w);
+	} else if (n < 0) {
+		memcpy(freed, region + height + n, sizeof *freed * -n);
+		memmove(region - n, region, sizeof *region * (height + n));
+		memcpy(region, freed, sizeof *freed * -n);
+		emulator_erase(e, e->top * w, (e->top - n) * w);
+	}
+}
+
+// emulator_linefeed moves the cursor down, scrolling at the region's bottom.
+static void emulator_linefeed(struct emulator *e) {
+	e->wrap_pending = false;
+	if (e->y != e->bottom) {
+		if (e->y < e->rows - 1)
+			e->y++;
+		return;
+	}
+
+	if (!e->alt && !e->top)
+		emulator_line(e, 0, &e->scrollback);
+	emulator_scroll(e, 1);
+}
+
+// emulator_put prints a character at the cursor position.
+static void emulator_put(struct emulator *e, uint32_t cp) {
+	if (e->wrap_pending) {
+		e->x = 0;
+		emulator_linefeed(e);
+	}
+	e->grid[e->y][e->x] = cp;
+	if (e->x < e->cols - 1)
+		e->x++;
+	else
+		e->wrap_pending = true;
+}
+
+// emulator_move places the cursor, clamping it to the screen.
+static void emulator_move(struct emulator *e, int y, int x) {
+	e->y = y < 0 ? 0 : y >= e->rows ? e->rows - 1 : y;
+	e->x = x < 0 ? 0 : x >= e->cols ? e->cols - 1 : x;
+	e->wrap_pending = false;
+}
+
+// emulator_mode returns the DECRPM status of a mode.
+static int emulator_mode(struct emulator *e, bool dec, int number) {
+	for (size_t i = 0; i < e->set_modes_len; i++)
+		if (e->set_modes[i] == (dec ? number : -number))
+			return DEC_SET;
+	for (size_t i = 0; i < sizeof known_modes / sizeof *known_modes; i++)
+		if (known_modes[i].dec == dec && known_modes[i].number == number)
+			return DEC_RESET;
+	return DEC_UNKNOWN;
+}
+
+// emulator_set_mode implements SM and RM, including the alternate screen.
+static void emulator_set_mode(
+	struct emulator *e, bool dec, int number, bool set) {
+	int key = dec ? number : -number;
+	size_t i = 0;
+	while (i < e->set_modes_len && e->set_modes[i] != key)
+		i++;
+	if ((i < e->set_modes_len) == set)
+		return;
+
+	if (!set)
+		e->set_modes[i] = e->set_modes[--e->set_modes_len];
+	else if (e->set_modes_len < sizeof e->set_modes / sizeof *e->set_modes)
+		e->set_modes[e->set_modes_len++] = key;
+	else
+		return;
+
+	if (dec && (number == 47 || number == 1047 || number == 1049)) {
+		if (number == 1049 && set) {
+			e->saved_x = e->x;
+			e->saved_y = e->y;
+		}
+
+		uint32_t **grid = e->grid;
+		e->grid = e->alt_grid;
+		e->alt_grid = grid;
+		e->alt = set;
+		if (set)
+			emulator_erase(e, 0, e->rows * e->cols);
+		if (number == 1049 && !set)
+			emulator_move(e, e->saved_y, e->saved_x);
+	}
+}
+
+// emulator_colour formats an SGR colour, given the base for indexed colours.
+static int emulator_colour(char *p, size_t len, int base, int colour) {
+	if (colour & EM_RGB)
+		return snprintf(p, len, ";%d:2::%d:%d:%d", base + 8,
+			colour >> 16 & 0xff, colour >> 8 & 0xff, colour & 0xff);
+	if (colour >= 16 || base == 50)
+		return snprintf(p, len, ";%d:5:%d", base + 8, colour);
+	if (colour >= 8)
+		return snprintf(p, len, ";%d", base + 60 + colour - 8);
+	return snprintf(p, len, ";%d", base + colour);
+}
+
+// emulator_sgr_string describes current attributes for DECRQSS.
+static void emulator_sgr_string(struct emulator *e, char *p, size_t len) {
+	int n = snprintf(p, len, "0");
+	for (int i = 1; i < 10; i++)
+		if (e->attrs & 1 << i)
+			n += snprintf(p + n, len - n, ";%d", i);
+	if (e->attrs & 1 << EM_OVERLINE)
+		n += snprintf(p + n, len - n, ";53");
+	if (e->fg >= 0)
+		n += emulator_colour(p + n, len - n, 30, e->fg);
+	if (e->bg >= 0)
+		n += emulator_colour(p + n, len - n, 40, e->bg);
+	if (e->ul >= 0)
+		n += emulator_colour(p + n, len - n, 50, e->ul);
+}
+
+enum { EM_MAX_PARAMS = 32 };
+
+// A parsed control sequence.
+struct csi {
+	char private;                       // Parameter prefix, such as ?
+	int params[EM_MAX_PARAMS];          // Parameters, -1 when omitted
+	bool colon[EM_MAX_PARAMS];          // Preceded by a colon
+	int len;                            // Number of parameters
+	char intermediate;                  // Last intermediate byte, or 0
+	char final;                         // The final byte
+};
+
+// csi_parse splits up a control sequence, sans the introducer.
+static void csi_parse(struct csi *c, const char *s, size_t len) {
+	*c = (struct csi) { .final = s[len - 1] };
+	size_t i = 0;
+	if (s[i] && strchr("<=>?", s[i]))
+		c->private = s[i++];
+
+	c->params[0] = -1;
+	for (; i < len - 1 && s[i] >= 0x30 && s[i] <= 0x3f; i++) {
+		if (s[i] >= '0' && s[i] <= '9') {
+			int *p = &c->params[c->len];
+			*p = (*p < 0 ? 0 : *p) * 10 + s[i] - '0';
+			if (*p > 65535)
+				*p = 65535;
+		} else if ((s[i] == ';' || s[i] == ':') &&
+			c->len + 1 < EM_MAX_PARAMS) {
+			c->colon[++c->len] = s[i] == ':';
+			c->params[c->len] = -1;
+		}
+	}
+	c->len++;
+	for (; i < len - 1; i++)
+		c->intermediate = s[i];
+}
+
+// csi_count returns a parameter that counts something, at least 1.
+static int csi_count(const struct csi *c, int i) {
+	return i < c->len && c->params[i] > 0 ? c->params[i] : 1;
+}
+
+// csi_value returns a parameter with a default of zero.
+static int csi_value(const struct csi *c, int i) {
+	return i < c->len && c->params[i] > 0 ? c->params[i] : 0;
+}
+
+// emulator_sgr_colour parses an extended colour starting at parameter i,
+// and returns the index of the last parameter that belongs to it.
+static int emulator_sgr_colour(const struct csi *c, int i, int *colour) {
+	int end = i + 1;
+	if (end < c->len && c->colon[end]) {
+		// ISO 8613-6: 38:5:n, or 38:2:[colour space]:r:g:b
+		while (end + 1 < c->len && c->colon[end + 1])
+			end++;
+		int n = end - i;
+		const int *p = c->params + i;
+		if (p[1] == 5 && n >= 2)
+			*colour = p[2] & 0xff;
+		else if (p[1] == 2 && n >= 4)
+			*colour = EM_RGB | (p[n - 2] & 0xff) << 16 |
+				(p[n - 1] & 0xff) << 8 | (p[n] & 0xff);
+		return end;
+	}
+
+	// The widespread semicolon form: 38;5;n, or 38;2;r;g;b
+	if (end < c->len && c->params[end] == 5 && end + 1 < c->len) {
+		*colour = c->params[end + 1] & 0xff;
+		return end + 1;
+	}
+	if (end < c->len && c->params[end] == 2 && end + 3 < c->len) {
+		*colour = EM_RGB | (c->params[end + 1] & 0xff) << 16 |
+			(c->params[end + 2] & 0xff) << 8 | (c->params[end + 3] & 0xff);
+		return end + 3;
+	}
+	return end < c->len ? end : c->len - 1;
+}
+
+// emulator_sgr changes current attributes.
+static void emulator_sgr(struct emulator *e, const struct csi *c) {
+	for (int i = 0; i < c->len; i++) {
+		int p = c->params[i] < 0 ? 0 : c->params[i];
+		if (p == 0) {
+			e->attrs = 0;
+			e->fg = e->bg = e->ul = -1;
+		} else if (p < 10) {
+			e->attrs |= 1 << p;
+		} else if (p == 22) {
+			e->attrs &= ~(1 << 1 | 1 << 2);
+		} else if (p > 22 && p < 30) {
+			e->attrs &= ~(1 << (p - 20));
+		} else if (p >= 30 && p < 38) {
+			e->fg = p - 30;
+		} else if (p == 38) {
+			i = emulator_sgr_colour(c, i, &e->fg);
+		} else if (p == 39) {
+			e->fg = -1;
+		} else if (p >= 40 && p < 48) {
+			e->bg = p - 40;
+		} else if (p == 48) {
+			i = emulator_sgr_colour(c, i, &e->bg);
+		} else if (p == 49) {
+			e->bg = -1;
+		} else if (p == 53) {
+			e->attrs |= 1 << EM_OVERLINE;
+		} else if (p == 55) {
+			e->attrs &= ~(1 << EM_OVERLINE);
+		} else if (p == 58) {
+			i = emulator_sgr_colour(c, i, &e->ul);
+		} else if (p == 59) {
+			e->ul = -1;
+		} else if (p >= 90 && p < 98) {
+			e->fg = p - 90 + 8;
+		} else if (p >= 100 && p < 108) {
+			e->bg = p - 100 + 8;
+		}
+	}
+}
+
+// emulator_csi executes a control sequence.
+static void emulator_csi(
+	struct emulator *e, const char *s, size_t len, struct buffer *replies) {
+	struct csi c;
+	csi_parse(&c, s, len);
+
+	char buf[256] = "";
+	int n = csi_count(&c, 0), w = e->cols;
+	switch (c.private << 16 | c.intermediate << 8 | c.final) {
+	case 'A':
+		emulator_move(e, e->y - n, e->x);
+		break;
+	case 'B':
+	case 'e':
+		emulator_move(e, e->y + n, e->x);
+		break;
+	case 'C':
+	case 'a':
+		emulator_move(e, e->y, e->x + n);
+		break;
+	case 'D':
+		emulator_move(e, e->y, e->x - n);
+		break;
+	case 'E':
+		emulator_move(e, e->y + n, 0);
+		break;
+	case 'F':
+		emulator_move(e, e->y - n, 0);
+		break;
+	case 'G':
+	case '`':
+		emulator_move(e, e->y, n - 1);
+		break;
+	case 'H':
+	case 'f':
+		emulator_move(e, n - 1, csi_count(&c, 1) - 1);
+		break;
+	case 'd':
+		emulator_move(e, n - 1, e->x);
+		break;
+	case 'J':
+		switch (csi_value(&c, 0)) {
+		case 0:
+			emulator_erase(e, e->y * w + e->x, e->rows * w);
+			break;
+		case 1:
+			emulator_erase(e, 0, e->y * w + e->x + 1);
+			break;
+		default:
+			emulator_erase(e, 0, e->rows * w);
+		}
+		break;
+	case 'K':
+		switch (csi_value(&c, 0)) {
+		case 0:
+			emulator_erase(e, e->y * w + e->x, (e->y + 1) * w);
+			break;
+		case 1:
+			emulator_erase(e, e->y * w, e->y * w + e->x + 1);
+			break;
+		default:
+			emulator_erase(e, e->y * w, (e->y + 1) * w);
+		}
+		break;
+	case 'X':
+		emulator_erase(e, e->y * w + e->x,
+			e->y * w + (e->x + n < w ? e->x + n : w));
+		break;
+	case '@':
+	case 'P': {
+		uint32_t *line = e->grid[e->y];
+		if (n > w - e->x)
+			n = w - e->x;
+		if (c.final == '@')
+			memmove(line + e->x + n, line + e->x,
+				sizeof *line * (w - e->x - n));
+		else
+			memmove(line + e->x, line + e->x + n,
+				sizeof *line * (w - e->x - n));
+		emulator_erase(e, e->y * w + (c.final == '@' ? e->x : w - n),
+			e->y * w + (c.final == '@' ? e->x + n : w));
+		break;
+	}
+	case 'L':
+	case 'M':
+		if (e->y >= e->top && e->y <= e->bottom) {
+			int top = e->top;
+			e->top = e->y;
+			emulator_scroll(e, c.final == 'L' ? -n : n);
+			e->top = top;
+		}
+		break;
+	case 'S':
+		emulator_scroll(e, n);
+		break;
+	case 'T':
+		emulator_scroll(e, -n);
+		break;
+	case 'r':
+		e->top = n - 1;
+		e->bottom = (c.len > 1 && c.params[1] > 0 ? c.params[1] : e->rows) - 1;
+		if (e->bottom >= e->rows)
+			e->bottom = e->rows - 1;
+		if (e->top >= e->bottom) {
+			e->top = 0;
+			e->bottom = e->rows - 1;
+		}
+		emulator_move(e, 0, 0);
+		break;
+	case 's':
+		e->saved_x = e->x;
+		e->saved_y = e->y;
+		break;
+	case 'u':
+		emulator_move(e, e->saved_y, e->saved_x);
+		break;
+	case 'm':
+		emulator_sgr(e, &c);
+		break;
+	case 'h':
+	case 'l':
+	case '?' << 16 | 'h':
+	case '?' << 16 | 'l':
+		for (int i = 0; i < c.len; i++)
+			if (c.params[i] > 0)
+				emulator_set_mode(
+					e, c.private == '?', c.params[i], c.final == 'h');
+		break;
+	case 'n':
+		if (c.params[0] == 5)
+			snprintf(buf, sizeof buf, CSI "0n");
+		else if (c.params[0] == 6)
+			snprintf(buf, sizeof buf, CSI "%d;%dR", e->y + 1, e->x + 1);
+		break;
+	case 'c':
+		if (csi_value(&c, 0) == 0)
+			snprintf(buf, sizeof buf, CSI "?62;22c");
+		break;
+	case '>' << 16 | 'c':
+		if (csi_value(&c, 0) == 0)
+			snprintf(buf, sizeof buf, CSI ">1;0;0c");
+		break;
+	case '=' << 16 | 'c':
+		if (csi_value(&c, 0) == 0)
+			snprintf(buf, sizeof buf, DCS "!|00000000" ST);
+		break;
+	case '>' << 16 | 'q':
+		if (csi_value(&c, 0) == 0)
+			snprintf(buf, sizeof buf, DCS ">|termtest" ST);
+		break;
+	case '$' << 8 | 'p':
+	case '?' << 16 | '$' << 8 | 'p':
+		snprintf(buf, sizeof buf, CSI "%s%d;%d$y", c.private ? "?" : "",
+			csi_value(&c, 0),
+			emulator_mode(e, c.private == '?', csi_value(&c, 0)));
+		break;
+	case ' ' << 8 | 'q':
+		e->cursor_style = csi_value(&c, 0);
+		break;
+	}
+	buffer_append(replies, buf, strlen(buf));
+}
+
+// emulator_osc executes an operating system command.
+static void emulator_osc(struct emulator *e, char *s, const char *st,
+	struct buffer *replies) {
+	char *end = NULL, buf[256] = "";
+	long cmd = strtol(s, &end, 10);
+	if (end == s || (*end && *end != ';'))
+		return;
+
+	if (cmd == 4) {
+		// Pairs of colour indexes and either queries or specifications.
+		for (char *p = end; p && *p == ';'; ) {
+			long index = strtol(p + 1, &end, 10);
+			if (*end != ';' || index < 0 || index > 255)
+				break;
+
+			char *spec = end + 1;
+			p = strchr(spec, ';');
+			if (p)
+				*p = 0;
+			if (!strcmp(spec, "?")) {
+				uint32_t rgb = e->palette[index];
+				snprintf(buf, sizeof buf, OSC "4;%ld;rgb:%04x/%04x/%04x%s",
+					index, (rgb >> 16 & 0xff) * 0x101,
+					(rgb >> 8 & 0xff) * 0x101, (rgb & 0xff) * 0x101, st);
+				buffer_append(replies, buf, strlen(buf));
+			} else {
+				unsigned r = 0, g = 0, b = 0;
+				if (sscanf(spec, "rgb:%2x/%2x/%2x", &r, &g, &b) == 3)
+					e->palette[index] = r << 16 | g << 8 | b;
+			}
+			if (p)
+				*p = ';';
+		}
+	} else if (cmd == 104 && !*end) {
+		emulator_palette(e);
+	} else if (cmd == 104) {
+		// Only the listed colours get reset, if there are any.
+		for (char *p = end; *p == ';'; p = end) {
+			long index = strtol(p + 1, &end, 10);
+			if (end == p + 1 || index < 0 || index > 255)
+				break;
+			e->palette[index] = emulator_default_colour(index);
+		}
+	} else if (cmd == 52 && *end) {
+		char *data = strchr(end + 1, ';');
+		if (!data)
+			return;
+		if (strcmp(++data, "?")) {
+			e->clipboard = strdup(data);
+			return;
+		}
 
-#include <curses.h>
-#include <term.h>
+		buffer_append(replies, OSC "52;c;", 7);
+		if (e->clipboard)
+			buffer_append(replies, e->clipboard, strlen(e->clipboard));
+		buffer_append(replies, st, strlen(st));
+	}
+}
 
-// tiparm is ncurses-specific, let's make this a tiny bit more portable.
-#define TIPARM(s, v1) tparm((s), (long) (v1))
+// emulator_dcs executes a device control string.
+static void emulator_dcs(struct emulator *e, const char *s,
+	struct buffer *replies) {
+	char buf[512] = "";
+	if (!strcmp(s, "$qm")) {
+		emulator_sgr_string(e, buf, sizeof buf - 1);
+		strcat(buf, "m");
+	} else if (!strcmp(s, "$qr")) {
+		snprintf(buf, sizeof buf, "%d;%dr", e->top + 1, e->bottom + 1);
+	} else if (!strcmp(s, "$q q")) {
+		snprintf(buf, sizeof buf, "%d q", e->cursor_style);
+	} else if (strncmp(s, "$q", 2)) {
+		return;
+	}
 
-#define CSI "\x1b["
-#define OSC "\x1b]"
-#define DCS "\x1bP"
-#define ST  "\x1b\\"
-#define ST8 "\x9c"
-#define BEL "\x07"
+	buffer_append(replies, DCS, 2);
+	buffer_append(replies, *buf ? "1$r" : "0$r", 3);
+	buffer_append(replies, buf, strlen(buf));
+	buffer_append(replies, ST, 2);
+}
 
-#define SGR0 CSI "m"
+// emulator_string executes a finished control string.
+static void emulator_string(struct emulator *e, const char *st,
+	struct buffer *replies) {
+	char *s = e->seq.s;
+	if (*s == ']')
+		emulator_osc(e, s + 1, st, replies);
+	else if (*s == 'P')
+		emulator_dcs(e, s + 1, replies);
+}
 
-extern char **environ;
-static struct termios saved_termios;
-struct winsize ws;
+// emulator_esc executes an escape sequence, sans the ESC.
+static void emulator_esc(struct emulator *e, const char *s, size_t len) {
+	if (len != 1)
+		return;
+
+	switch (*s) {
+	case '7':
+		e->saved_x = e->x;
+		e->saved_y = e->y;
+		break;
+	case '8':
+		emulator_move(e, e->saved_y, e->saved_x);
+		break;
+	case 'D':
+		emulator_linefeed(e);
+		break;
+	case 'E':
+		e->x = 0;
+		emulator_linefeed(e);
+		break;
+	case 'M':
+		if (e->y == e->top)
+			emulator_scroll(e, -1);
+		else
+			emulator_move(e, e->y - 1, e->x);
+		break;
+	}
+}
 
-// tty_atexit restores the terminal into its original mode. Some of the tested
-// extensions can't be reset by terminfo strings, so don't bother with that.
-static void tty_atexit() { tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios); }
+// emulator_control executes a C0 control character.
+static void emulator_control(struct emulator *e, unsigned char c) {
+	switch (c) {
+	case '\b':
+		emulator_move(e, e->y, e->x - 1);
+		break;
+	case '\t':
+		emulator_move(e, e->y, (e->x / 8 + 1) * 8);
+		break;
+	case '\n':
+	case '\v':
+	case '\f':
+		emulator_linefeed(e);
+		break;
+	case '\r':
+		e->x = 0;
+		e->wrap_pending = false;
+		break;
+	}
+}
 
-// tty_cbreak puts the terminal in the cbreak mode.
-static bool tty_cbreak() {
-	if (tcgetattr(STDIN_FILENO, &saved_termios) < 0)
-		return false;
+// emulator_feed processes a byte of output.
+static void emulator_feed(
+	struct emulator *e, unsigned char c, struct buffer *replies) {
+	switch (e->state) {
+	case EM_GROUND:
+		if (e->continuation && (c & 0xc0) == 0x80) {
+			e->cp = e->cp << 6 | (c & 0x3f);
+			if (!--e->continuation)
+				emulator_put(e, e->cp);
+		} else if (c == 0x1b) {
+			e->state = EM_ESC;
+			e->seq.len = 0;
+		} else if (c < 0x20 || c == 0x7f) {
+			emulator_control(e, c);
+		} else if (c < 0x80) {
+			emulator_put(e, c);
+		} else if ((e->continuation = utf8_continuation(c))) {
+			e->cp = c & (0x3f >> e->continuation);
+		} else {
+			emulator_put(e, 0xfffd);
+		}
+		return;
+	case EM_ESC:
+		if (c == '[') {
+			e->state = EM_CSI;
+		} else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X') {
+			e->state = EM_STRING;
+			buffer_append(&e->seq, &c, 1);
+		} else if (c >= 0x20 && c < 0x30) {
+			buffer_append(&e->seq, &c, 1);
+		} else {
+			buffer_append(&e->seq, &c, 1);
+			emulator_esc(e, e->seq.s, e->seq.len);
+			e->state = EM_GROUND;
+		}
+		return;
+	case EM_CSI:
+		if (c == 0x18 || c == 0x1a) {
+			e->state = EM_GROUND;
+		} else if (c < 0x20) {
+			emulator_control(e, c);
+		} else {
+			buffer_append(&e->seq, &c, 1);
+			if (c >= 0x40 && c <= 0x7e) {
+				emulator_csi(e, e->seq.s, e->seq.len, replies);
+				e->state = EM_GROUND;
+			}
+		}
+		return;
+	case EM_STRING:
+		if (c == '\a') {
+			emulator_string(e, BEL, replies);
+			e->state = EM_GROUND;
+		} else if (c == 0x1b) {
+			e->state = EM_STRING_ESC;
+		} else if (c == 0x18 || c == 0x1a) {
+			e->state = EM_GROUND;
+		} else {
+			buffer_append(&e->seq, &c, 1);
+		}
+		return;
+	case EM_STRING_ESC:
+		if (c == '\\') {
+			emulator_string(e, ST, replies);
+			e->state = EM_GROUND;
+		} else {
+			// Another sequence has started, this one is thus cancelled.
+			e->state = EM_ESC;
+			e->seq.len = 0;
+			emulator_feed(e, c, replies);
+		}
+		return;
+	}
+}
 
-	struct termios buf = saved_termios;
-	buf.c_lflag &= ~(ECHO | ICANON);
-	buf.c_cc[VMIN] = 1;
-	buf.c_cc[VTIME] = 0;
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &buf) < 0)
-		return false;
+// emulator_respond is a responder that emulates a terminal, then passes
+// the output on to the script, if there is any.
+static void emulator_respond(
+	void *ctx, const char *data, size_t len, struct buffer *replies) {
+	struct emulator *e = ctx;
+	for (size_t i = 0; i < len; i++)
+		emulator_feed(e, data[i], replies);
+	if (e->script)
+		script_respond(e->script, data, len, replies);
+}
 
-	if (tcgetattr(STDIN_FILENO, &buf) < 0 || (buf.c_lflag & (ECHO | ICANON)) ||
-		buf.c_cc[VMIN] != 1 || buf.c_cc[VTIME] != 0) {
-		tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
-		return false;
-	}
-	return true;
+// emulator_dump prints out everything that has been written to the main
+// screen, as plain text, leaving out trailing empty lines.
+static void emulator_dump(struct emulator *e) {
+	struct buffer text = {0};
+	buffer_append(&text, e->scrollback.s, e->scrollback.len);
+	uint32_t **grid = e->grid;
+	if (e->alt)
+		e->grid = e->alt_grid;
+	for (int y = 0; y < e->rows; y++)
+		emulator_line(e, y, &text);
+	e->grid = grid;
+
+	while (text.len > 1 && text.s[text.len - 1] == '\n' &&
+		text.s[text.len - 2] == '\n')
+		text.len--;
+	fwrite(text.s, 1, text.len, stdout);
 }
 
-// comm writes a string to the terminal and waits for a result. Returns NULL
-// if it didn't manage to get a response, or when an error has happened.
-static char *comm(const char *req, bool wait_first) {
-	ssize_t len = write(STDOUT_FILENO, req, strlen(req));
-	if (len < strlen(req))
+// A target is a command prefix, such as "tmux new-session", that gets
+// the test appended to it, and is run on a pseudoterminal of its own.
+struct target {
+	const char *command;                // Shell command prefix
+	char *results_path;                 // Temporary file with JSON results
+	pid_t worker;                       // Process driving the target
+	double start;                       // When the target has been started
+	double elapsed;                     // Milliseconds until it has finished
+	int status;                         // Exit status of the worker
+	bool timed_out;                     // Killed for exceeding the deadline
+
+	char **features, **values;          // Collected results
+	size_t len;                         // Number of collected results
+};
+
+// json_field extracts a string field from a line of JSON as written by
+// result_write(). Returns NULL if the field is missing or null.
+static char *json_field(const char *line, const char *key) {
+	char pattern[64] = "";
+	snprintf(pattern, sizeof pattern, "\"%s\":\"", key);
+	const char *p = strstr(line, pattern);
+	if (!p)
 		return NULL;
 
-	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
-	if (wait_first)
-		poll(&pfd, 1, -1);
+	char *value = calloc(1, strlen(p) + 1), *out = value;
+	for (p += strlen(pattern); *p && *p != '"'; p++) {
+		unsigned int c = 0;
+		if (*p != '\\') {
+			*out++ = *p;
+		} else if (p[1] == 'u' && sscanf(p + 2, "%4x", &c) == 1 && c < 256) {
+			*out++ = c;
+			p += 5;
+		} else if (p[1]) {
+			*out++ = *++p;
+		}
+	}
+	return value;
+}
 
-	int lag = getenv("SSH_CONNECTION") ? 250 : 50;
-	char buf[1000] = "";
-	size_t buf_len = 0;
-	int n = 0;
-	while ((n = poll(&pfd, 1, lag /* unreliable, timing-dependent */))) {
-		if (n < 0)
-			return NULL;
+// drive_start runs the test within a target, in a worker process
+// that is responding to it with the built-in emulator.
+static void drive_start(struct target *t, const char *self, char **options) {
+	char *template = strdup("/tmp/termtest-XXXXXX");
+	int fd = mkstemp(template);
+	if (fd < 0)
+		abort();
+	close(fd);
 
-		len = read(STDIN_FILENO, buf + buf_len, sizeof buf - buf_len - 1);
-		if (len <= 0)
-			return NULL;
+	t->results_path = template;
+	t->start = clock_msec();
+	if ((t->worker = fork()) < 0)
+		abort();
+	if (t->worker)
+		return;
+
+	pid_t child = 0;
+	int master = harness_start(&child);
+	if (master < 0) {
+		size_t n = 0;
+		while (options[n])
+			n++;
+
+		// The target receives the test as separate, unquoted arguments.
+		char **args = calloc(n + 9, sizeof *args), **a = args;
+		char *script = malloc(strlen(t->command) + 8);
+		sprintf(script, "%s \"$@\"", t->command);
+		*a++ = "sh";
+		*a++ = "-c";
+		*a++ = script;
+		*a++ = "sh";
+		*a++ = (char *) self;
+		*a++ = "-n";
+		*a++ = "-j";
+		*a++ = t->results_path;
+		memcpy(a, options, (n + 1) * sizeof *a);
+		execv("/bin/sh", args);
+		_exit(127);
+	}
+
+	struct emulator e;
+	emulator_init(&e, HARNESS_ROWS, HARNESS_COLS);
+	_exit(harness_run(master, child, emulator_respond, &e, false));
+}
 
-		buf_len += len;
+// drive_collect reads in the results of a finished target.
+static void drive_collect(struct target *t) {
+	FILE *fp = fopen(t->results_path, "r");
+	if (!fp)
+		return;
+
+	char *line = NULL;
+	size_t alloc = 0;
+	while (getline(&line, &alloc, fp) > 0) {
+		char *feature = json_field(line, "feature");
+		if (!feature)
+			continue;
+
+		t->features = realloc(t->features, sizeof *t->features * (t->len + 1));
+		t->values = realloc(t->values, sizeof *t->values * (t->len + 1));
+		t->features[t->len] = feature;
+		t->values[t->len++] = json_field(line, "value");
 	}
-	return strdup(buf);
+	fclose(fp);
+	unlink(t->results_path);
 }
 
-enum { DEC_UNKNOWN, DEC_SET, DEC_RESET, DEC_PERMSET, DEC_PERMRESET };
+// drive_lookup finds the value of a feature within a target's results.
+// Returns false if it hasn't been reported at all.
+static bool drive_lookup(
+	const struct target *t, const char *feature, const char **value) {
+	for (size_t i = 0; i < t->len; i++) {
+		if (!strcmp(t->features[i], feature)) {
+			*value = t->values[i];
+			return true;
+		}
+	}
+	return false;
+}
 
-// decrpmstr returns a textual description of a DECRPM response.
-static const char *decrpmstr(int status) {
-	switch (status) {
-	case DEC_UNKNOWN:
-		return "unknown";
-	case DEC_SET:
-		return "set";
-	case DEC_RESET:
-		return "reset";
-	case DEC_PERMSET:
-		return "permanently set";
-	case DEC_PERMRESET:
-		return "permanently reset";
-	default:
-		return "?";
+// drive_table prints out all results side by side.
+static void drive_table(const struct target *targets, size_t len) {
+	// Features are listed in the order of their first appearance.
+	const char **features = NULL;
+	size_t features_len = 0;
+	for (size_t i = 0; i < len; i++) {
+		for (size_t k = 0; k < targets[i].len; k++) {
+			size_t f = 0;
+			while (f < features_len &&
+				strcmp(features[f], targets[i].features[k]))
+				f++;
+			if (f < features_len)
+				continue;
+
+			features = realloc(features, sizeof *features * (features_len + 1));
+			features[features_len++] = targets[i].features[k];
+		}
+	}
+
+	printf("%-32s", "");
+	for (size_t i = 0; i < len; i++)
+		printf(" #%-19zu", i + 1);
+	printf("\n");
+	for (size_t f = 0; f < features_len; f++) {
+		printf("%-32.32s", features[f]);
+		for (size_t i = 0; i < len; i++) {
+			const char *value = "-";
+			if (drive_lookup(&targets[i], features[f], &value) && !value)
+				value = "(none)";
+			printf(" %-20.20s", value);
+		}
+		printf("\n");
 	}
 }
 
-// parse_decrpm returns whether the mode response is valid (result >= 0),
-// as well as the terminal's response if it is, see the DEC_* constants.
-static int parse_decrpm(const char *resp) {
-	// E.g., \x1b[?1000;2$y
-	if (resp[0] != '\x1b' || resp[1] != '[' || resp[2] != '?')
-		return -1;
+// drive runs the test within all targets, as many at once as there are
+// processor cores, and prints out a comparison table. Targets that take
+// longer than deadline milliseconds get killed. Returns the number
+// of targets that have failed.
+static int drive(struct target *targets, size_t len, const char *self,
+	char **options, double deadline) {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1)
+		cores = 1;
+
+	size_t next = 0, running = 0;
+	int failed = 0;
+	while (next < len || running) {
+		if (next < len && running < (size_t) cores) {
+			drive_start(&targets[next++], self, options);
+			running++;
+			continue;
+		}
 
-	char *end = NULL;
-	errno = 0;
-	long mode = strtol(resp + 3, &end, 10);
-	if (errno || mode < 0 || *end != ';')
-		return -1;
-	if (!isdigit(end[1]) || end[2] != '$' || end[3] != 'y' || end[4])
-		return -1;
-	return end[1] - '0';
+		// Hanging targets mustn't keep unattended comparisons from finishing.
+		int status = 0;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+		if (pid < 0 && errno == EINTR)
+			continue;
+		if (pid < 0)
+			break;
+		if (!pid) {
+			for (size_t i = 0; i < next; i++) {
+				struct target *t = &targets[i];
+				if (!t->elapsed && !t->timed_out &&
+					clock_msec() - t->start > deadline) {
+					t->timed_out = true;
+					kill(t->worker, SIGKILL);
+				}
+			}
+			nanosleep(&(struct timespec) { .tv_nsec = 50000000 }, NULL);
+			continue;
+		}
+
+		for (size_t i = 0; i < next; i++) {
+			struct target *t = &targets[i];
+			if (t->worker != pid)
+				continue;
+
+			t->elapsed = clock_msec() - t->start;
+			t->status = WIFEXITED(status) && !t->timed_out
+				? WEXITSTATUS(status) : EXIT_FAILURE;
+			failed += !!t->status;
+			drive_collect(t);
+			running--;
+		}
+	}
+
+	printf("-- Comparison\n");
+	for (size_t i = 0; i < len; i++) {
+		const struct target *t = &targets[i];
+		printf("#%-3zu %s: ", i + 1, t->command);
+		if (t->timed_out)
+			printf("timed out");
+		else if (t->status)
+			printf("failed with status %d", t->status);
+		else
+			printf("finished");
+		printf(" in %.1f s, %zu results\n", t->elapsed / 1000, t->len);
+	}
+	drive_table(targets, len);
+	return failed;
 }
 
-// deccheck checks whether a particular DEC mode is supported, whether it is
-// enabled, and returns that information as a string.
-static const char *deccheck(int number) {
-	char buf[1000] = "";
-	snprintf(buf, sizeof buf, CSI "?%d$p", number);
-	return decrpmstr(parse_decrpm(comm(buf, false)));
+// trace_varint_read decodes a LEB128 number from a trace.
+// Returns false if it is truncated.
+static bool trace_varint_read(const struct buffer *b, size_t *i, uint64_t *n) {
+	*n = 0;
+	for (int shift = 0; *i < b->len && shift < 64; shift += 7) {
+		unsigned char c = b->s[(*i)++];
+		*n |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
 }
 
-// test_mouse tests whether a particular mouse mode is supported.
-static void test_mouse(int mode) {
-	ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
-	comm(CSI "?1002l" CSI "?1003l" CSI "?1005l"
-		CSI "?1006l" CSI "?1015l" CSI "?1016l" CSI "?1000h", false);
+// replay_token counts in a single token of recorded input, as far as
+// the parsers used by the test understand it, optionally describing it.
+static void replay_token(char *token, size_t counts[4], bool verbose) {
+	char detail[100] = "";
+	const char *protocol = NULL;
+	int status = parse_decrpm(token);
+	if (status >= 0) {
+		if (verbose)
+			printf("DECRPM %.*s: %s\n", (int) strcspn(token + 2, ";"),
+				token + 2, decrpmstr(status));
+		counts[0]++;
+	} else if (!strncmp(token, DCS "0$r", 5)) {
+		if (verbose)
+			printf("DECRPSS: invalid request\n");
+		counts[1]++;
+	} else if (!strncmp(token, DCS "1$r", 5)) {
+		if (verbose)
+			printf("DECRPSS: %s\n", parse_decrpss(token));
+		counts[1]++;
+	} else if ((protocol = parse_mouse(token, detail, sizeof detail))) {
+		if (verbose)
+			printf("Mouse: %s (%s)\n", protocol, detail);
+		counts[2]++;
+	} else {
+		counts[3]++;
+	}
+}
 
-	char buf[100] = "";
-	snprintf(buf, sizeof buf, CSI "?%dh" "%d: ", mode, mode);
-	char *resp = comm(buf, true);
+// replay analyses a recorded trace without any terminal: it passes input
+// through our parsers, and computes latencies and throughput from the time
+// between what was sent, and what came back. Individual responses are only
+// described when verbose, as there may be tens of thousands of them.
+// Returns false on failure.
+static bool replay(const char *path, bool verbose) {
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return false;
 
-	unsigned int b = -1, x = -1, y = -1;
-	unsigned char bc = -1, xc = -1, yc = -1, m = -1;
-	if (sscanf(resp, CSI "M%c%c%c", &bc, &xc, &yc) == 3 &&
-		bc >= 32 && xc >= 32 && yc >= 32) {
-		// Beware that this isn't compatible with xterm run with the -lc switch.
-		if (strlen(resp) > 6) {
-			printf("1005? ");
-			for (const char *p = resp; *p; p++)
-				printf("%c", *p < 32 || *p > 127 ? '.' : *p);
-			printf("\n");
-		} else {
-			printf("1000/1005 (%d @ %d,%d)\n", bc - 32, xc - 32, yc - 32);
-		}
-	} else if (sscanf(resp, CSI "<%u;%u;%u%c", &b, &x, &y, &m) == 4 &&
-		(m == 'm' || m == 'M')) {
-		printf("%s (%u%c @ %u,%u)\n",
-			(x > ws.ws_col || y > ws.ws_row) ? "1016" : "1006/1016",
-			b, m, x, y);
-	} else if (sscanf(resp, CSI "%u;%u;%u%c", &b, &x, &y, &m) == 4 &&
-		m == 'M') {
-		printf("1015 (%u @ %u,%u)\n", b - 32, x, y);
-	} else {
-		printf("Failed to parse.\n");
+	struct buffer data = {0};
+	for (size_t len;
+		(len = fread(buffer_reserve(&data, 65536), 1, 65536, fp)); )
+		data.len += len;
+	fclose(fp);
+
+	size_t i = sizeof TRACE_MAGIC - 1;
+	uint64_t wall = 0;
+	if (data.len < i || memcmp(data.s, TRACE_MAGIC, i) ||
+		!trace_varint_read(&data, &i, &wall)) {
+		errno = EINVAL;
+		return false;
 	}
 
-	comm("Waiting for button up events, press a key if hanging.\n", true);
-}
+	printf("-- Replay\n");
+	time_t started = wall / 1000000000;
+	char date[64] = "";
+	strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", localtime(&started));
+	printf("Recorded at %s\n", date);
+
+	// Responses are timed from the last output that has preceded them.
+	struct samples latency = {0};
+	struct scanner sc = { .state = SC_GROUND };
+	struct buffer token = {0};
+	uint64_t now = 0, request = 0, first[2] = {0}, last[2] = {0};
+	size_t bytes[2] = {0}, records[2] = {0}, counts[4] = {0};
+	bool requested = false;
+	while (i < data.len) {
+		uint64_t delta = 0, len = 0;
+		if (!trace_varint_read(&data, &i, &delta) || i >= data.len)
+			break;
 
-// parse_decrpss checks a DECRPSS sequence and cuts out the inner part.
-// Returns NULL if it fails to validate.
-static char *parse_decrpss(char *resp) {
-	if (strncmp(resp, DCS "1$r", 5))
-		return NULL;
+		char direction = data.s[i++];
+		if (!trace_varint_read(&data, &i, &len) || len > data.len - i)
+			break;
 
-	*strpbrk(resp + 5, BEL ST8 "\x1b") = 0;
-	return resp + 5;
-}
+		now += delta;
+		int d = direction == TRACE_INPUT;
+		if (!records[d]++)
+			first[d] = now;
+		last[d] = now;
+		bytes[d] += len;
 
-// colour prints a cell with the given indexed colour as a background.
-static void colour(int n) {
-	n > 7 ? printf(CSI "48;5;%dm ", n) : printf(CSI "%dm ", 40 + n);
+		if (!d) {
+			request = now;
+			requested = true;
+		}
+		if (d && requested) {
+			samples_add(&latency, (now - request) / 1e6);
+			requested = false;
+		}
+		for (size_t k = 0; d && k < len; k++) {
+			buffer_append(&token, data.s + i + k, 1);
+			if (scanner_feed(&sc, data.s[i + k])) {
+				replay_token(token.s, counts, verbose);
+				token.len = 0;
+			}
+		}
+		i += len;
+	}
+	if (i < data.len)
+		printf("The trace is truncated.\n");
+
+	static const char *directions[] = { "Output", "Input" };
+	static const char *features[] = { "Replay, output", "Replay, input" };
+	for (int d = 0; d < 2; d++) {
+		printf("%-14s%zu bytes in %zu records", directions[d], bytes[d],
+			records[d]);
+		double seconds = (last[d] - first[d]) / 1e9;
+		char value[64] = "";
+		if (seconds > 0) {
+			snprintf(value, sizeof value, "%.2f MiB/s",
+				bytes[d] / 1048576. / seconds);
+			printf(", %s", value);
+		}
+		printf("\n");
+
+		result(features[d], NULL, *value ? value : NULL, -1,
+			d ? 0 : bytes[d], d ? bytes[d] : 0);
+	}
+	printf("%-14s%zu DECRPM, %zu DECRPSS, %zu mouse, %zu other\n", "Responses:",
+		counts[0], counts[1], counts[2], counts[3]);
+	printf("%-14s", "Latency:");
+	samples_print("Replay, latency", &latency);
+	return true;
 }
 
-// direct prints a cell with the given direct colour as a background.
-// sep can be set either to ':' for ISO-8613-6 or ';' for more compatibility.
-static void direct(char sep, int r, int g, int b) {
-	printf(CSI "48%c2%c%d%c%d%c%dm ", sep, sep, r, sep, g, sep, b);
+// usage prints a short summary of command line arguments, and exits.
+static void usage(const char *program) {
+	fprintf(stderr,
+		"Usage: %s [-bEfmnv] [-c DIR] [-D TARGET]... [-H SCRIPT] [-j FILE]"
+		" [-p COUNT] [-r FILE] [-s MIB] [-t SECONDS] [-T FILE]"
+		" [NAME...]\n"
+		"  -b  only run benchmarks\n"
+		"  -c  cache -j results in DIR, keyed by the terminal's identity\n"
+		"  -D  run within the TARGET command on a separate pseudoterminal,\n"
+		"      in parallel with other targets, and compare the results\n"
+		"  -E  run on a pseudoterminal with a built-in reference emulator\n"
+		"  -f  ignore cached results, and replace them\n"
+		"  -H  run on a pseudoterminal that replies according to a script\n"
+		"  -j  write results as JSON lines to FILE, or a descriptor number\n"
+		"  -m  only sweep through DEC private and ANSI modes\n"
+		"  -n  batch mode, skip everything that needs user interaction\n"
+		"  -p  only profile query latencies, sending each query COUNT times\n"
+		"  -r  analyse a trace recorded by -T, without using the terminal\n"
+		"  -s  amount of data for benchmarks to send, in MiB\n"
+		"  -t  give up after SECONDS, by default 30 in batch mode\n"
+		"  -T  record a binary trace of all terminal I/O to FILE\n"
+		"  -v  with -r, also describe each recorded response\n", program);
+	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
+	bool sweep = false, bench = false, emulate = false, refresh = false;
+	bool verbose = false;
+	size_t bench_size = 8 << 20, profile_count = 0;
+	unsigned int budget = 0;
+	const char *script_path = NULL, *results_path = NULL, *cache_dir = NULL;
+	const char *trace_path = NULL, *replay_path = NULL;
+	const char *profile_arg = NULL, *size_arg = NULL, *budget_arg = NULL;
+
+	// Targets of the driver get to run the same kind of test.
+	struct target *targets = NULL;
+	size_t targets_len = 0;
+	for (int c; (c = getopt(argc, argv, "bc:D:EfH:j:mnp:r:s:t:T:v")) != -1; ) {
+		switch (c) {
+		case 'b':
+			bench = true;
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'D':
+			targets = realloc(targets, sizeof *targets * (targets_len + 1));
+			targets[targets_len++] = (struct target) { .command = optarg };
+			break;
+		case 'E':
+			emulate = true;
+			break;
+		case 'f':
+			refresh = true;
+			break;
+		case 'H':
+			script_path = optarg;
+			break;
+		case 'j':
+			results_path = optarg;
+			break;
+		case 'm':
+			sweep = true;
+			break;
+		case 'n':
+			interactive = false;
+			break;
+		case 'p':
+			if (!(profile_count = strtoul(optarg, NULL, 10)))
+				usage(argv[0]);
+			profile_arg = optarg;
+			break;
+		case 'r':
+			replay_path = optarg;
+			break;
+		case 's':
+			if (!(bench_size = parse_mib(optarg))) {
+				fprintf(stderr, "%s: -s takes 1 to %d MiB\n", argv[0],
+					BENCH_MAX_MIB);
+				usage(argv[0]);
+			}
+			size_arg = optarg;
+			break;
+		case 't':
+			if (!(budget = strtoul(optarg, NULL, 10)))
+				usage(argv[0]);
+			budget_arg = optarg;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (targets_len && (results_path || cache_dir)) {
+		fprintf(stderr, "%s: -j and -c can't be combined with -D\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (cache_dir && !results_path) {
+		fprintf(stderr, "%s: -c only caches what -j writes\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (targets_len) {
+		// Each option is only passed on once, whatever its last value was.
+		char *forward[16] = {0}, **f = forward;
+		if (bench)
+			*f++ = "-b";
+		if (sweep)
+			*f++ = "-m";
+		if (profile_arg) {
+			*f++ = "-p";
+			*f++ = (char *) profile_arg;
+		}
+		if (size_arg) {
+			*f++ = "-s";
+			*f++ = (char *) size_arg;
+		}
+		if (budget_arg) {
+			*f++ = "-t";
+			*f++ = (char *) budget_arg;
+		}
+
+		char self[4096] = "";
+		ssize_t len = readlink("/proc/self/exe", self, sizeof self - 1);
+		if (len <= 0)
+			snprintf(self, sizeof self, "%s", argv[0]);
+		// Targets run in batch mode, so they have a budget, plus some slack
+		// for starting up and shutting down.
+		double deadline = ((budget ? budget : 30) + 10) * 1000.;
+		return drive(targets, targets_len, self, forward, deadline)
+			? EXIT_FAILURE : 0;
+	}
+
+	struct script script = {0};
+	if (script_path && !script_load(&script, script_path)) {
+		perror(script_path);
+		exit(EXIT_FAILURE);
+	}
+
+	// A separate channel keeps results apart from the test patterns.
+	if (results_path) {
+		if (results_path[strspn(results_path, "0123456789")])
+			results = fopen(results_path, "w");
+		else
+			results = fdopen(atoi(results_path), "w");
+		if (!results) {
+			perror(results_path);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (replay_path) {
+		if (replay(replay_path, verbose))
+			return 0;
+
+		perror(replay_path);
+		exit(EXIT_FAILURE);
+	}
+
+	// The emulator shows what has ended up on its screen once finished,
+	// so that benchmark output doesn't get in the way.
+	pid_t child = 0;
+	int master = -1;
+	if ((script_path || emulate) && (master = harness_start(&child)) >= 0) {
+		if (!emulate)
+			return harness_run(master, child, script_respond, &script, true);
+
+		struct emulator e;
+		emulator_init(&e, HARNESS_ROWS, HARNESS_COLS);
+		e.script = script_path ? &script : NULL;
+		int status = harness_run(master, child, emulator_respond, &e, false);
+		emulator_dump(&e);
+		return status;
+	}
+
+	if (trace_path && !trace_open(trace_path)) {
+		perror(trace_path);
+		exit(EXIT_FAILURE);
+	}
 	if (!tty_cbreak())
 		abort();
 
+	// Alarms aren't inherited by children, so this only covers the test itself.
+	if (!budget && !interactive)
+		budget = 30;
+	if (budget) {
+		signal(SIGALRM, budget_exceeded);
+		alarm(budget);
+		deadline = clock_msec() + budget * 1000.;
+	}
+
 	// Identify the terminal emulator, which is passed by arguments.
-	for (int i = 1; i < argc; i++)
+	for (int i = optind; i < argc; i++)
 		printf("%s ", argv[i]);
 	printf("\n");
 
+	// This is meant to be fast enough to be run from login scripts,
+	// which also means that we can't wait for the user to press a key.
+	if (sweep) {
+		printf("-- Mode sweep\n");
+		sweep_modes();
+		tty_atexit();
+		return 0;
+	}
+	if (bench) {
+		printf("-- Text throughput\n");
+		bench_text(bench_size);
+		printf("-- Scrolling\n");
+		bench_scroll(bench_size);
+		printf("-- Attribute churn\n");
+		bench_sgr(bench_size);
+		printf("-- Unicode text\n");
+		bench_unicode(bench_size);
+		printf("-- Synchronized output\n");
+		bench_sync(bench_size);
+		printf("-- Mouse decoding\n");
+		bench_mouse(bench_size);
+
+		// Don't clobber the clipboard of someone who isn't watching.
+		if (interactive) {
+			printf("-- OSC 52 round trips\n");
+			bench_clipboard(bench_size);
+		}
+		tty_atexit();
+		return 0;
+	}
+	if (profile_count) {
+		printf("-- Query latency\n");
+		profile_queries(profile_count);
+		tty_atexit();
+		return 0;
+	}
+
 	// Initialise terminfo, this should definitely succeed.
 	int err;
 	char *term = getenv("TERM");
@@ -220,9 +3637,111 @@ int main(int argc, char *argv[]) {
 		abort();
 
 	// VTE wouldn't have sent a response to DECRQM otherwise!
-	comm("-- Press any key to start\n", true);
+	if (interactive)
+		comm("-- Press any key to start\n", true);
+
+	// This takes a single round trip, and decides whether to go any further.
+	struct batch identity = {0};
+	size_t da2_q = batch_add(&identity, CSI ">", CSI ">c");
+	size_t da3_q = batch_add(&identity, DCS "!|", CSI "=c");
+	size_t xtversion_q = batch_add(&identity, DCS ">|", CSI ">0q");
+	batch_run(&identity, response_timeout());
+
+	char *cache_path = NULL;
+	if (cache_dir) {
+		cache_path = malloc(strlen(cache_dir) + 64);
+		sprintf(cache_path, "%s/termtest-%016llx.json", cache_dir,
+			(unsigned long long) identity_key(term, &identity));
+		if (!refresh && cache_replay(cache_path)) {
+			tty_atexit();
+			return 0;
+		}
+
+		// Concurrent sessions mustn't see each other's partial results.
+		mkdir(cache_dir, 0777);
+		cache_partial = malloc(strlen(cache_path) + 32);
+		sprintf(cache_partial, "%s.%ld", cache_path, (long) getpid());
+		if (!(cache = fopen(cache_partial, "w"))) {
+			perror(cache_partial);
+			cache_partial = NULL;
+		}
+	}
+
+	rtt_calibrate();
+
+	// Send all automatic queries at once, so that they take a single RTT.
+	// Sequences that need no response ride along to keep the order right.
+	struct batch probe = {0};
+	int modes[] = { 1000, 1003, 1004, 1005, 1006, 1015, 1016, 2004 };
+	for (size_t i = 0; i < sizeof modes / sizeof *modes; i++)
+		batch_decrqm(&probe, true, modes[i]);
+
+	// Check the confusion, see https://gist.github.com/XVilka/8346728
+	size_t sgr5_semi_q = batch_decrqss(&probe, CSI "48;5;160m", "m");
+	size_t sgr5_colon_q = batch_decrqss(&probe, CSI "48:5:161m", "m");
+	size_t sgr2_colon_q = batch_decrqss(&probe, CSI "48:2::255:0:0m", "m");
+	size_t sgr2_double_q = batch_decrqss(&probe, CSI "48:2::0:255:0m", "m");
+	batch_add(&probe, NULL, SGR0);
+
+	size_t cursor_q = batch_decrqss(&probe, "", " q");
+	size_t bright_red_q = batch_add(&probe, OSC "4;", OSC "4;9;?" BEL);
+	batch_run(&probe, response_timeout());
 
 	printf("-- Identification\nTERM=%s\n", term);
+	result("TERM", NULL, term, -1, 0, 0);
+	result("DA1", probe.da1, probe.da1 ? probe.da1 + 2 : NULL,
+		probe.da1 ? probe.rtt : -1, 3, probe.da1 ? strlen(probe.da1) : 0);
+
+	struct query *da2 = &identity.queries[da2_q];
+	long da2_type = -1, da2_version = -1;
+	if (parse_da2(da2->resp, &da2_type, &da2_version))
+		printf("DA2: type %ld, version %ld\n", da2_type, da2_version);
+	result_query("DA2", da2, da2->resp ? da2->resp + 2 : NULL);
+
+	struct query *da3 = &identity.queries[da3_q];
+	char *unit_id = parse_string(da3->resp, DCS "!|"), *unit_text = NULL;
+	if (unit_id && (unit_text = da3_text(unit_id)))
+		printf("DA3: unit ID %s (%s)\n", unit_id, unit_text);
+	else if (unit_id)
+		printf("DA3: unit ID %s\n", unit_id);
+	result_query("DA3", da3, unit_id);
+
+	struct query *xtversion = &identity.queries[xtversion_q];
+	char *xtversion_text = parse_string(xtversion->resp, DCS ">|");
+	if (xtversion_text)
+		printf("XTVERSION: %s\n", xtversion_text);
+	result_query("XTVERSION", xtversion, xtversion_text);
+
+	// XTVERSION is the most specific, usually either "name(version)",
+	// or "name version". DA2 versions are rather arbitrary numbers.
+	char *emulator = NULL, *version = NULL;
+	if (xtversion_text && *xtversion_text) {
+		emulator = strdup(xtversion_text);
+		if ((version = strpbrk(emulator, "( "))) {
+			*version++ = 0;
+			version[strcspn(version, ")")] = 0;
+		}
+	} else if (da2_type >= 0 && da2_name(da2_type)) {
+		emulator = strdup(da2_name(da2_type));
+		version = malloc(32);
+		if (da2_type == 65)
+			snprintf(version, 32, "0.%ld.%ld",
+				da2_version / 100, da2_version % 100);
+		else
+			snprintf(version, 32, "%ld", da2_version);
+	}
+	if (emulator) {
+		char *description = malloc(strlen(emulator) + 64);
+		strcpy(description, emulator);
+		if (version && *version)
+			sprintf(description + strlen(description), " %.60s", version);
+		printf("Emulator: %s\n", description);
+		result("Emulator", NULL, description, -1, 0, 0);
+	} else {
+		printf("Emulator: unknown\n");
+		result("Emulator", NULL, NULL, -1, 0, 0);
+	}
+
 	char *upperterm = strdup(term);
 	for (char *p = upperterm; *p; p++)
 		*p = toupper(*p);
@@ -232,10 +3751,23 @@ int main(int argc, char *argv[]) {
 			printf("%s ", *p);
 	printf("\n");
 
+	printf("-- Round-trip time\n");
+	if (rtt.valid) {
+		printf("%.3f ms, variation %.3f ms\n", rtt.srtt, rtt.rttvar);
+		char buf[32] = "";
+		snprintf(buf, sizeof buf, "%.3f", rtt.srtt);
+		result("RTT", NULL, buf, rtt.srtt, 0, 0);
+	} else {
+		printf("Unknown, neither DA1 nor CPR has been responded to.\n");
+		result("RTT", NULL, NULL, -1, 0, 0);
+	}
+
 	printf("-- DECRQM: ");
-	char *rpm = comm(CSI "?1000$p", false);
-	bool decrqm_supported = rpm && parse_decrpm(rpm) >= 0;
+	bool decrqm_supported =
+		parse_decrpm(batch_find(&probe, CSI "?1000$p")->resp) >= 0;
 	printf("%d\n", decrqm_supported);
+	for (size_t i = 0; i < sizeof modes / sizeof *modes; i++)
+		result_decrqm(&probe.queries[i]);
 
 	printf("-- Colours\n");
 	start_color(); // Does this need initscr()?  ncurses doesn't initialise.
@@ -257,16 +3789,14 @@ int main(int argc, char *argv[]) {
 	if (Tc && Tc != (char *) -1)
 		printf("Terminfo: tmux extension claims direct color.\n");
 
-	// Check the confusion, see https://gist.github.com/XVilka/8346728
 	char *sgr5_semi =
-		parse_decrpss(comm(CSI "48;5;160m"      DCS "$qm" ST "\r", false));
+		probe_decrpss("SGR 160, semicolon", &probe.queries[sgr5_semi_q]);
 	char *sgr5_colon =
-		parse_decrpss(comm(CSI "48:5:161m"      DCS "$qm" ST "\r", false));
+		probe_decrpss("SGR 161, colon", &probe.queries[sgr5_colon_q]);
 	char *sgr2_colon =
-		parse_decrpss(comm(CSI "48:2::255:0:0m" DCS "$qm" ST "\r", false));
-	char *sgr2_double =
-		parse_decrpss(comm(CSI "48:2::0:255:0m" DCS "$qm" ST "\r", false));
-	comm(SGR0, false);
+		probe_decrpss("SGR #ff0000, colon", &probe.queries[sgr2_colon_q]);
+	char *sgr2_double = probe_decrpss("SGR #00ff00, double colon",
+		&probe.queries[sgr2_double_q]);
 
 	if (sgr5_semi)
 		printf("SGR 160, semicolon:        %s\n", sgr5_semi);
@@ -290,39 +3820,41 @@ int main(int argc, char *argv[]) {
 		!!can_change, !!initialize_color);
 
 	// The response from urxvt is wrongly missing the colour number.
-	char *bright_red_save = comm(OSC "4;9;?" BEL, false);
-	if (!strncmp(bright_red_save, OSC "4;", 4)) {
-		char *copy = strdup(bright_red_save + 4);
+	char *bright_red_save = probe.queries[bright_red_q].resp, *copy = NULL;
+	if (bright_red_save) {
+		copy = strdup(bright_red_save + 4);
 		*strpbrk(copy, BEL ST8 "\x1b") = 0;
 		printf("We have read colour contents from the terminal: %s\n", copy);
-	} else
-		*bright_red_save = 0;
-
-	printf(CSI "0;38;5;9m" "Indexed" SGR0 " " CSI "1;31m" "Bold" SGR0 "\n");
-	printf("Press a key to stop.\n");
-	for (int r = 0; r < 255; r += 8) {
-		char buf[1000] = "";
-		snprintf(buf, sizeof buf, OSC "4;9;rgb:%02x/%02x/%02x" BEL, r, 0, 0);
-		if (*comm(buf, false))
-			break;
-
-		poll(NULL, 0, 50 /* delay */);
 	}
-	if (*bright_red_save)
-		comm(bright_red_save, false);
-	else
-		comm(OSC "104;9" BEL, false);
+	result_query("OSC 4 colour 9", &probe.queries[bright_red_q], copy);
 
-	// Linux palette sequence, supported by e.g. pterm.
-	for (int r = 0; r < 255; r += 8) {
-		char buf[1000] = "";
-		snprintf(buf, sizeof buf, OSC "P9%02x%02x%02x", r, 0, 0);
-		if (*comm(buf, false))
-			break;
+	printf(CSI "0;38;5;9m" "Indexed" SGR0 " " CSI "1;31m" "Bold" SGR0 "\n");
 
-		poll(NULL, 0, 50 /* delay */);
+	// Animations are only worth anything to someone who is watching.
+	if (interactive) {
+		printf("Press a key to stop.\n");
+		struct buffer key = {0};
+		for (int r = 0; r < 255; r += 8) {
+			char buf[1000] = "";
+			snprintf(buf, sizeof buf,
+				OSC "4;9;rgb:%02x/%02x/%02x" BEL, r, 0, 0);
+			if (!tty_puts(buf) || tty_read(&key, 50 /* delay */))
+				break;
+		}
+		if (bright_red_save)
+			tty_puts(bright_red_save);
+		else
+			tty_puts(OSC "104;9" BEL);
+
+		// Linux palette sequence, supported by e.g. pterm.
+		for (int r = 0; r < 255; r += 8) {
+			char buf[1000] = "";
+			snprintf(buf, sizeof buf, OSC "P9%02x%02x%02x", r, 0, 0);
+			if (!tty_puts(buf) || tty_read(&key, 50 /* delay */))
+				break;
+		}
+		tty_puts("\a\r"); // Take care of unsupporting terminals.
 	}
-	comm("\a\r", false); // Take care of unsupporting terminals.
 
 	printf("-- Bold and blink attributes\n");
 	bool bbc_supported = enter_bold_mode && enter_blink_mode &&
@@ -381,21 +3913,23 @@ int main(int argc, char *argv[]) {
 		printf("Terminfo: found tmux extension for setting.\n");
 	if (Se && Se != (char *) -1)
 		printf("Terminfo: found tmux extension for resetting.\n");
-	if (parse_decrpss(comm(DCS "$q q" ST "\r", false)))
+	if (probe_decrpss("DECSCUSR", &probe.queries[cursor_q]))
 		printf("DECRQSS told us about cursor appearance!\n");
 
-	comm(CSI "5 q" "Blinking (press a key): ", true);
-	printf("\n");
-	comm(CSI "6 q" "Steady (press a key): ", true);
-	printf("\n");
+	if (interactive) {
+		comm(CSI "5 q" "Blinking (press a key): ", true);
+		printf("\n");
+		comm(CSI "6 q" "Steady (press a key): ", true);
+		printf("\n");
+	}
 
 	// There's no widely supported way of restoring this to what it was before.
 	// Terminfo "cnorm" at most undoes blinking in xterm.
-	comm(CSI "2 q", false);
+	tty_puts(CSI "2 q");
 
 	printf("-- w3mimgdisplay\n");
 	const char *windowid = getenv("WINDOWID");
-	if (windowid) {
+	if (windowid && interactive) {
 		printf("WINDOWID=%s\n", windowid);
 		printf("There should be a picture. Press a key.\n");
 		poll(NULL, 0, 50 /* wait for a refresh */);
@@ -417,8 +3951,8 @@ int main(int argc, char *argv[]) {
 	}
 
 	printf("-- Sixel graphics\n");
-	char *da1 = comm(CSI "c", false);
-	if (!strncmp(da1, CSI "?", 3)) {
+	char *da1 = probe.da1;
+	if (da1) {
 		char *p = da1 + 3, *end = p;
 		long mode;
 		while ((mode = strtol(p, &end, 10)) && (*end == ';' || *end == 'c')) {
@@ -428,26 +3962,37 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	comm(CSI "4c" DCS "0;0;0;q??~~??~~??iTiTiT" ST, false);
+	tty_puts(CSI "4c" DCS "0;0;0;q??~~??~~??iTiTiT" ST);
 
 	printf("-- Mouse protocol\n");
 	// TODO: Inspect terminfo kmous, XM, xm.
 	//  - We can say what protocol kmous expects, whether 1000 or 1006.
 	//     - Sadly urxvt still has the 1000/1005 sequence there.
-	while (!ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) && ws.ws_col < 223) {
+	while (interactive &&
+		!ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) && ws.ws_col < 223) {
 		if (!*comm("Your terminal needs to be at least 223 columns wide.\n"
 			"Press a key once you've made it wide enough.\n", true))
 			break;
 	}
 
-	printf("Click the rightmost column, if it's possible.\n");
+	if (interactive)
+		printf("Click the rightmost column, if it's possible.\n");
 	int mouses[] = { 1005, 1006, 1015, 1016 };
 	for (size_t i = 0; i < sizeof mouses / sizeof *mouses; i++) {
 		if (decrqm_supported)
-			printf("DECRQM(%d): %s\n", mouses[i], deccheck(mouses[i]));
-		test_mouse(mouses[i]);
+			printf("DECRQM(%d): %s\n", mouses[i], deccheck(&probe, mouses[i]));
+		if (interactive)
+			test_mouse(mouses[i]);
 	}
-	comm(CSI "?1000l", false);
+	tty_puts(CSI "?1000l");
+	if (interactive)
+		fence();
+
+	printf("-- Mouse motion\n");
+	if (decrqm_supported)
+		printf("DECRQM(1003): %s\n", deccheck(&probe, 1003));
+	if (interactive)
+		bench_motion();
 
 	printf("-- Focus events\n");
 	const char *Dsfcs = tigetstr("Dsfcs");
@@ -455,27 +4000,26 @@ int main(int argc, char *argv[]) {
 	if (Dsfcs && Dsfcs != (char *) -1 && Enfcs && Enfcs != (char *) -1)
 		printf("Terminfo: found tmux extension.\n");
 	if (decrqm_supported)
-		printf("DECRQM: %s\n", deccheck(1004));
-	comm(CSI "?1000h" CSI "?1004h", false);
-	printf("Focus in and out of the window, press a key to abort.\n");
-	while (true) {
-		char *in = comm("", true);
-		if (*in != '\x1b')
-			break;
-		else if (in[1] == '[' && in[2] == 'I')
-			printf("Focused in.\n");
-		else if (in[1] == '[' && in[2] == 'O')
-			printf("Focused out.\n");
-	}
-	comm(CSI "?1000l" CSI "?1004l", false);
+		printf("DECRQM: %s\n", deccheck(&probe, 1004));
+	tty_puts(CSI "?1000h" CSI "?1004h");
+	if (interactive)
+		test_focus();
+	tty_puts(CSI "?1000l" CSI "?1004l");
+	if (interactive)
+		fence();
 
 	printf("-- Selection\n");
 	const char *Ms = tigetstr("Ms");
 	if (Ms && Ms != (char *) -1)
 		printf("Terminfo: found tmux extension.\n");
 
-	char *selection = comm(OSC "52;pc;?" BEL, false);
-	if (!strncmp(selection, OSC "52;", 5)) {
+	// The clipboard's contents are nobody else's business,
+	// so don't even ask for them when nobody is watching.
+	char *selection = interactive ? comm(OSC "52;pc;?" BEL, false) : NULL;
+	bool readable = selection && !strncmp(selection, OSC "52;", 5);
+	if (interactive)
+		result_comm("OSC 52", NULL, readable ? "readable" : NULL);
+	if (readable) {
 		printf("We have received the selection from the terminal!" CSI "1m\n");
 		char *semi = strrchr(selection, ';');
 		*strpbrk(semi, BEL ST8 "\x1b") = 0;
@@ -485,8 +4029,12 @@ int main(int argc, char *argv[]) {
 		printf(CSI "m\n");
 	}
 
-	comm(OSC "52;pc;VGVzdA==" BEL /* ST didn't work, UTF-8 issues? */, false);
-	comm("Check if the selection now contains 'Test' and press a key.\n", true);
+	// Don't clobber the clipboard of someone who isn't watching.
+	if (interactive) {
+		tty_puts(OSC "52;pc;VGVzdA==" BEL /* ST didn't work, UTF-8 issues? */);
+		comm("Check if the selection now contains 'Test' and press a key.\n",
+			true);
+	}
 
 	printf("-- Bracketed paste\n");
 	const char *Dsbp = tigetstr("Dsbp");
@@ -494,16 +4042,25 @@ int main(int argc, char *argv[]) {
 	if (Dsbp && Dsbp != (char *) -1 && Enbp && Enbp != (char *) -1)
 		printf("Terminfo: found tmux extension.\n");
 	if (decrqm_supported)
-		printf("DECRQM: %s\n", deccheck(2004));
+		printf("DECRQM: %s\n", deccheck(&probe, 2004));
 
 	// We might consider xdotool... though it can't operate the clipboard,
 	// so we'd have to use Xlib, and that is too much effort.
-	char *pasted = comm(CSI "?2004h" "Paste something: ", true);
-	printf("%d\n", !strncmp(pasted, CSI "200~", 6));
-	comm(CSI "?2004l", false);
+	if (interactive)
+		bench_paste(bench_size);
+
+	if (cache) {
+		fclose(cache);
+		if (rename(cache_partial, cache_path))
+			perror(cache_path);
+		cache = NULL;
+		cache_partial = NULL;
+	}
 
 	// Let the user see the results when run outside an interactive shell.
-	comm("-- Finished\n", true);
+	tty_puts("-- Finished\n");
+	if (interactive)
+		comm("", true);
 
 	// atexit is broken in tcc -run, see https://savannah.nongnu.org/bugs/?56495
 	tty_atexit();